@@ -12,6 +12,7 @@
 #include <stdio.h>
 #include <math.h>
 #include <memory.h>
+#include <string.h>
 #include <windows.h>
 #include <winbase.h>
 #pragma hdrstop
@@ -24,31 +25,420 @@
 /* DLL Private Functions And Data Declarations                              */
 /*--------------------------------------------------------------------------*/
 
+/* Pipelined command records 
+   Every command sent to the device leaves a record of what response is expected
+   and where the caller wants the results.  Records are kept in order in the 
+   pipeline window so that responses can be matched to their commands as they 
+   are collected, which is what allows several commands to be in flight at once.
+*/
+typedef struct 
+ {
+  BYTE ResponseToken;         // Token expected in the response
+  BYTE Kind;                  // How the response is returned to the caller (HW_RESPONSE_...)
+  BYTE Limit;                 // Maximum number of bytes to return in Content
+  BYTE *Count;                // Count returned by reference (may be NULL)
+  void *Content;              // Data or status returned by reference (may be NULL)
+  struct HW_JOB *Job;         // Job waiting on the result (NULL if nobody waits)
+  BYTE Posted;                // Posted write, its status held for the next synchronous call
+  BYTE Sequenced;             // Command carried a sequence number, so its response does too
+  BYTE Sequence;              // Sequence number the command carried
+ } HW_REQUEST;
+
+// Whether the executor collects the response as soon as it arrives
+// Others are collected when the window is full or the pipeline is collected
+#define HW_AWAITED(Request)         (((Request)->Job != NULL) || (Request)->Posted)
+
+// Whether the device firmware reported a feature, per the CAPABILITY_BIT definitions of the ICD
+// A missing device is let through so that the usual path reports it
+#define HW_SUPPORTS(Device, Bit)    (((Device) == NULL) || ((Device)->Capabilities.Features & (Bit)))
+
+// Response kinds - each describes how the response data map to the caller arguments
+#define HW_RESPONSE_STATUS          0   /* Status, success if no error bit */
+#define HW_RESPONSE_STATUS_VALUE    1   /* Status, value returned in Content */
+#define HW_RESPONSE_VALUE           2   /* Exactly Limit bytes returned in Content */
+#define HW_RESPONSE_DATA            3   /* Data returned in Content and count in Count */
+#define HW_RESPONSE_COUNT           4   /* Count only returned in Count */
+#define HW_RESPONSE_I2C_WRITE       5   /* I2C count returned from the message header */
+#define HW_RESPONSE_I2C_READ        6   /* I2C count and data returned from the message */
+
+// Largest window of commands allowed in flight
+// The window is further limited to the commands the device reports it can hold,
+// which is exactly one for the baseline firmware.
+#define HW_MAX_PIPELINE_WINDOW      16
+
+// Receive ring size for each device
+// The size is a power of two so positions can be masked rather than divided
+#define HW_RX_RING_SIZE             0x10000
+#define HW_RX_RING_MASK             (HW_RX_RING_SIZE - 1)
+
+// Largest number of devices kept in the device table
+#define HW_MAX_DEVICES              64
+
+// Highest pin number whose settings are kept for restoring after a reconnect
+#define HW_MAX_SHADOW_PIN           15
+
+// Time allowed for a response to start arriving, in mS
+// This is the same as the driver timeouts set when a device is opened
+#define HW_RESPONSE_TIMEOUT         2000
+
+// Time an I2C part is given to finish writing a piece before it acknowledges again, in mS
+// Only used for bulk writes to firmware without the bulk write command
+#define HW_I2C_WRITE_TIME           50
+
+// Time pin writes are held for combining before they are sent, in mS
+#define HW_COMBINE_DELAY            2
+
+// Largest number of serial stream packets sent ahead of their acknowledgements
+// Each packet is taken by the device as soon as the one before is done, so the
+// window only needs to cover the round trip
+#define HW_STREAM_WINDOW            4
+
+// Serial bytes pushed by the device that are kept for each device until read
+// The oldest are dropped if the application does not keep up
+#define HW_SERIAL_RING_SIZE         0x4000
+
+// Most samples pushed by the device that can be kept for each device until read
+// The depth asked for is rounded up to a power of 2 within this
+#define HW_MAX_SAMPLE_DEPTH         0x100000
+
+/* Error records
+   The last error found by each thread is kept for it in thread local storage,
+   and every error is also written to a ring shared by all threads so that 
+   errors found on executor threads, or by nobody in particular, can still be
+   read back.  Entries in the ring are claimed by an interlocked increment of
+   the sequence number, so recording an error never takes a lock.  The entry
+   sequence number is 0 while it is being written, which lets a reader tell
+   a whole entry from one being overwritten.
+*/
+typedef struct
+ {
+  DWORD Code;                                 // Error code (BHPMOD_ERROR_...)
+  char Detail[BHPMOD_MAX_ERROR_LENGTH];       // Description of the error
+ } HW_ERROR;
+
+typedef struct
+ {
+  volatile LONG Sequence;                     // Sequence number of the entry, 0 while written
+  HW_ERROR Error;                             // Error recorded
+ } HW_ERROR_ENTRY;
+
+// Number of errors kept in the error log ring
+#define HW_ERROR_LOG_SIZE           64
+
+/* Device context
+   Everything needed to talk to one device is kept here so that any number of
+   devices can be open at once.  The handle given to the caller points to this.
+   Contexts for open devices are kept in a list so that opening a device that 
+   is already open shares the same context.
+*/
+struct BHPMOD_DEVICE
+ {
+  HANDLE Handle;                              // Driver handle to the device
+  char SerialNumber[SI_MAX_DEVICE_STRLEN];    // Serial number the device reported when opened
+  DWORD References;                           // Number of opens not yet closed
+  struct BHPMOD_DEVICE *Next;                 // Next open device
+  BYTE Broken;                                // Driver reported an error, so reconnect before use
+  BHPMOD_CAPABILITIES Capabilities;           // What the firmware reported it can do when opened
+
+  // Last settings sent to the device, restored after a reconnect
+  // A configuration resets the pins on the device, so it clears the pin settings
+  WORD ShadowFlags;
+  BYTE ShadowConfiguration;
+  BYTE ShadowClockPhase;
+  BYTE ShadowClockDivider;
+  BYTE ShadowTiming[2];
+  BYTE ShadowI2cClock[2];
+  BYTE ShadowI2cTimeout[2];
+  BYTE ShadowSerialLine[5];
+  BYTE ShadowSerialBuffers[4];
+  BYTE ShadowSerialEvents[3];
+  BYTE ShadowAcquisition[62];
+  BYTE ShadowAcquisitionCount;
+  BYTE ShadowSampleEvents[3];
+  WORD ShadowDriveSet;
+  WORD ShadowStateSet;
+  BYTE ShadowDrive[HW_MAX_SHADOW_PIN + 1];
+  BYTE ShadowState[HW_MAX_SHADOW_PIN + 1];
+
+  // Receive ring holding bytes read from the driver but not yet parsed
+  BYTE RxRing[HW_RX_RING_SIZE];
+  DWORD RxHead;
+  DWORD RxCount;
+  // Overlapped read into the ring, at most one at a time
+  OVERLAPPED RxOverlapped;
+  DWORD RxRead;
+  BYTE RxPending;
+  // Tick count when a response was last received or awaited from an idle device
+  DWORD RxActivity;
+
+  // Pipeline window of commands sent for which responses have not been collected
+  // The records form a ring, oldest first, starting at the head
+  HW_REQUEST PipelineRequest[HW_MAX_PIPELINE_WINDOW];
+  BYTE PipelineHead;
+  BYTE PipelineCount;
+  // Number of commands allowed in flight and whether exports post rather than wait
+  BYTE PipelineWindow;
+  BYTE PipelineActive;
+  // Count of failed responses collected by the DLL on behalf of the caller
+  DWORD PipelineFailures;
+  // Thread that began the pipeline, which alone posts without waiting
+  volatile DWORD PipelineOwner;
+  // Number of commands in the window with a caller waiting on them, or posted
+  BYTE PipelineWaiting;
+
+  // Whether status only writes are posted without waiting
+  volatile BYTE PostedWrites;
+  // Error of the first posted write to fail since the last synchronous call
+  BYTE PostedFailed;
+  HW_ERROR PostedError;
+
+  // Whether commands carry sequence numbers, and the next number to use
+  volatile BYTE Sequencing;
+  BYTE SequenceNext;
+
+  // Whether pin writes are held for combining, the writes held, and when the first was held
+  volatile BYTE Combining;
+  WORD CombineDriveSet;
+  WORD CombineStateSet;
+  BYTE CombineDrive[HW_MAX_SHADOW_PIN + 1];
+  BYTE CombineState[HW_MAX_SHADOW_PIN + 1];
+  DWORD CombineStart;
+
+  // Serial bytes pushed by the device, handed to the callback if there is one and
+  // otherwise kept in a ring for BHPMOD_SERIAL_WaitRead
+  // The ring is filled by the executor and emptied by the application under the lock
+  volatile BYTE SerialEvents;
+  BHPMOD_SERIAL_CALLBACK SerialCallback;
+  void *SerialContext;
+  CRITICAL_SECTION SerialLock;
+  HANDLE SerialArrived;
+  BYTE SerialRing[HW_SERIAL_RING_SIZE];
+  DWORD SerialHead;
+  DWORD SerialCount;
+
+  // Timestamp of the last sample read from the acquisition job, as the device gave it and 
+  // counted on from the start of the job, so the device timestamps can be carried past 16 bits
+  WORD AcqStamp;
+  DWORD AcqTime;
+
+  // Samples pushed by the device, kept in a ring from which one reader takes them in place
+  // The executor alone moves the tail and the reader alone moves the head, so no lock is 
+  // needed, and each side counts what it had to drop
+  volatile BYTE SampleEvents;
+  BHPMOD_SAMPLE *SampleRing;
+  DWORD SampleMask;
+  volatile LONG SampleHead;
+  volatile LONG SampleTail;
+  HANDLE SampleArrived;
+  BYTE SampleSequence;
+  volatile LONG SamplesLost;
+  volatile LONG SamplesMissed;
+  volatile LONG SamplesDropped;
+
+  // Executor thread doing all traffic with the device, and the jobs queued for it
+  SLIST_HEADER Queue;
+  HANDLE Executor;
+  HANDLE Wakeup;
+  HMODULE Module;
+  volatile LONG Stopping;
+ };
+typedef struct BHPMOD_DEVICE HW_DEVICE;
+
+// Shadow flags - which settings have been sent
+#define HW_SHADOW_CONFIGURATION     0x01
+#define HW_SHADOW_CLOCK_PHASE       0x02
+#define HW_SHADOW_CLOCK_RATE        0x04
+#define HW_SHADOW_TIMING            0x08
+#define HW_SHADOW_I2C_CLOCK_RATE    0x10
+#define HW_SHADOW_I2C_TIMEOUT       0x20
+#define HW_SHADOW_SERIAL_LINE       0x40
+#define HW_SHADOW_SERIAL_BUFFERS    0x80
+#define HW_SHADOW_SERIAL_EVENTS     0x100
+#define HW_SHADOW_ACQUISITION       0x200
+#define HW_SHADOW_SAMPLE_EVENTS     0x400
+
+/* Device table
+   The attached BHPMOD devices are listed with their driver index and serial 
+   number.  Reading the product strings is slow, so the table is only built
+   again when the number of devices using the driver changes, or when a 
+   device asked for is not found in it.
+*/
+typedef struct 
+ {
+  DWORD DriverIndex;                          // Index of the device for the driver
+  char SerialNumber[SI_MAX_DEVICE_STRLEN];    // Serial number of the device
+ } HW_TABLE_ENTRY;
+
+/* Executor jobs
+   Each job is work queued by an application thread for the executor thread
+   of a device.  A command job carries a copy of the command so the caller's
+   buffers are only used for the results.  A call job runs a function on the
+   executor thread.  The queue link must come first for the lock-free list.
+*/
+typedef DWORD (*HW_FUNCTION)(HW_DEVICE *Device, void *Context);
+
+typedef struct DECLSPEC_ALIGN(MEMORY_ALLOCATION_ALIGNMENT) HW_JOB
+ {
+  SLIST_ENTRY Entry;          // Queue link
+  BYTE Kind;                  // What the job does (HW_JOB_...)
+  BYTE Token;                 // Command token
+  BYTE Count;                 // Command data count
+  BYTE Data[62];              // Command data
+  HW_REQUEST Request;         // What to do with the response
+  HW_FUNCTION Function;       // Function to call
+  void *Context;              // Argument for the function
+  DWORD Result;               // 1/0 result once finished
+  HANDLE Done;                // Event set when finished (NULL if nobody waits)
+  BHPMOD_CALLBACK Callback;   // Function called when finished instead (NULL if none)
+  void *CallbackContext;      // Argument for the callback
+  HW_ERROR Error;             // Error found by the executor if the job failed
+ } HW_JOB;
+
+// Job kinds
+#define HW_JOB_COMMAND              0   /* Post a command and complete it from its response */
+#define HW_JOB_CALL                 1   /* Call a function on the executor thread */
+#define HW_JOB_COMBINE              2   /* Hold a pin write for combining */
+
+#define RX_PEEK(Device, Offset)     (Device)->RxRing[((Device)->RxHead + (Offset)) & HW_RX_RING_MASK]
+// Header size and data count of the next response, once its token and count are held
+#define RX_HEADER(Device)           ((RX_PEEK((Device), 1) & COUNT_BIT_SEQUENCE) ? 3 : 2)
+#define RX_COUNT(Device)            (RX_PEEK((Device), 1) & ~COUNT_BIT_SEQUENCE)
+
 /* Primitive hardware functions */
-DWORD HW_Open(void);
-DWORD HW_Close(void);
-DWORD HW_SendDeviceCommand(BYTE Token, BYTE Count, void *DataMessage);
-DWORD HW_GetDeviceResponse(BYTE *Token, BYTE *Count, void *DataMessage);
+DWORD HW_RefreshTable(BYTE Force);
+DWORD HW_Enumerate(DWORD *NumDevices, DWORD BhPmodIndex, DWORD *DriverIndex, char *SerialNumber);
+DWORD HW_FindDevice(char *SerialNumber, DWORD *DriverIndex, char *FoundSerialNumber);
+DWORD HW_Open(char *SerialNumber, HW_DEVICE **Device, BYTE Quiet);
+HW_DEVICE *HW_ShareDevice(char *SerialNumber);
+DWORD HW_Close(HW_DEVICE *Device);
+HW_DEVICE *HW_DefaultDevice(void);
+DWORD HW_Reconnect(HW_DEVICE *Device);
+void HW_Shadow(HW_DEVICE *Device, BYTE Token, BYTE Count, BYTE *DataMessage);
+DWORD HW_Restore(HW_DEVICE *Device);
+DWORD HW_Exchange(HW_DEVICE *Device, BYTE Token, BYTE Count, void *DataMessage);
+DWORD HW_ExchangeRequest(HW_DEVICE *Device, BYTE Token, BYTE Count, void *DataMessage, HW_REQUEST *Request);
+DWORD HW_SendDeviceCommand(HW_DEVICE *Device, BYTE Token, BYTE Count, void *DataMessage, BYTE Sequenced, BYTE Sequence);
+DWORD HW_GetDeviceResponse(HW_DEVICE *Device, BYTE *Token, BYTE *Count, void *DataMessage);
+DWORD HW_FillReceive(HW_DEVICE *Device, DWORD Needed);
+DWORD HW_StartReceive(HW_DEVICE *Device);
+DWORD HW_FinishReceive(HW_DEVICE *Device);
+void HW_CancelReceive(HW_DEVICE *Device);
+DWORD HW_ResponseHeld(HW_DEVICE *Device);
+int HW_ResponseAge(HW_DEVICE *Device, HW_REQUEST *Request);
+void HW_FlushReceive(HW_DEVICE *Device);
+DWORD HW_TakeEvent(HW_DEVICE *Device, BYTE Wait);
+void HW_KeepSerial(HW_DEVICE *Device, DWORD Count, BYTE *Content);
+void HW_KeepSamples(HW_DEVICE *Device, DWORD Count, BYTE *Content);
+DWORD HW_PostCommand(HW_DEVICE *Device, BYTE Token, BYTE Count, void *DataMessage, HW_REQUEST *Request);
+DWORD HW_CollectResponse(HW_DEVICE *Device, BYTE Report);
+DWORD HW_LoseResponses(HW_DEVICE *Device, HW_REQUEST *Request, BYTE Report);
+void HW_FailInFlight(HW_DEVICE *Device);
+DWORD HW_CollectAll(HW_DEVICE *Device);
+DWORD HW_FinishRequest(HW_DEVICE *Device, HW_REQUEST *Request, DWORD Result, BYTE Report);
+
+/* Executor functions */
+DWORD HW_StartExecutor(HW_DEVICE *Device);
+void HW_StopExecutor(HW_DEVICE *Device);
+DWORD WINAPI HW_Executor(LPVOID Parameter);
+void HW_RunJob(HW_DEVICE *Device, HW_JOB *Job);
+void HW_QueueJob(HW_DEVICE *Device, HW_JOB *Job);
+DWORD HW_ExecuteJob(HW_DEVICE *Device, HW_JOB *Job);
+DWORD HW_Transact(HW_DEVICE *Device, BYTE Token, BYTE Count, void *DataMessage, HW_REQUEST *Request);
+DWORD HW_Submit(HW_DEVICE *Device, BYTE Token, BYTE Count, void *DataMessage, HW_REQUEST *Request);
+DWORD HW_Post(HW_DEVICE *Device, BYTE Token, BYTE Count, void *DataMessage, HW_REQUEST *Request);
+DWORD HW_QueueCommand(HW_DEVICE *Device, BYTE Kind, BYTE Token, BYTE Count, void *DataMessage, HW_REQUEST *Request);
+DWORD HW_SubmitAsync(HW_DEVICE *Device, BYTE Token, BYTE Count, void *DataMessage, HW_REQUEST *Request, BHPMOD_CALLBACK Callback, void *Context);
+DWORD HW_Call(HW_DEVICE *Device, HW_FUNCTION Function, void *Context);
+HANDLE HW_ThreadEvent(void);
+void HW_TakeError(HW_ERROR *Error);
+DWORD HW_PipelineBegin(HW_DEVICE *Device, void *Context);
+DWORD HW_PipelineCollect(HW_DEVICE *Device, void *Context);
+DWORD HW_PipelineEnd(HW_DEVICE *Device, void *Context);
+DWORD HW_Discover(HW_DEVICE *Device, void *Context);
+DWORD HW_Sequencing(HW_DEVICE *Device, void *Context);
+DWORD HW_SpiBulk(HW_DEVICE *Device, void *Context);
+DWORD HW_I2cBulkWrite(HW_DEVICE *Device, void *Context);
+DWORD HW_I2cBulkRead(HW_DEVICE *Device, void *Context);
+DWORD HW_SpiBulkBaseline(HW_DEVICE *Device, DWORD Length, BYTE *Write, BYTE *Read);
+DWORD HW_I2cBulkWriteBaseline(HW_DEVICE *Device, BYTE *Command, DWORD Length, BYTE *Content);
+DWORD HW_I2cBulkReadBaseline(HW_DEVICE *Device, BYTE *Command, DWORD Length, BYTE *Content);
+DWORD HW_SerialStream(HW_DEVICE *Device, void *Context);
+DWORD HW_SerialStreamBaseline(HW_DEVICE *Device, DWORD Length, BYTE *Content);
+DWORD HW_SerialEvents(HW_DEVICE *Device, void *Context);
+DWORD HW_Acquisition(HW_DEVICE *Device, void *Context);
+DWORD HW_ReadSamples(HW_DEVICE *Device, void *Context);
+DWORD HW_SampleEvents(HW_DEVICE *Device, void *Context);
+DWORD HW_PostedWrites(HW_DEVICE *Device, void *Context);
+DWORD HW_Fence(HW_DEVICE *Device, void *Context);
+DWORD HW_ReportPosted(HW_DEVICE *Device);
+DWORD HW_WriteCombining(HW_DEVICE *Device, void *Context);
+DWORD HW_Flush(HW_DEVICE *Device, void *Context);
+void HW_Combine(HW_DEVICE *Device, BYTE Token, BYTE *DataMessage);
+DWORD HW_CombineWait(HW_DEVICE *Device);
+void HW_FlushCombined(HW_DEVICE *Device);
 
 /* General purpose subroutine declarations */
-DWORD GetStatusResponse(BYTE *Status);
-DWORD ErrorMessage(char *ErrorDescription, char *ErrorType);
-#define ErrorNoDevice()             ErrorMessage("Device not properly identified", "API Parameter Error")
-#define ErrorFileNotFound()         ErrorMessage("Unable to open the specified file", "API Parameter Error")
-#define ErrorBadValue()             ErrorMessage("Specified value is out of range", "API Parameter Error")
-#define ErrorBadLength()            ErrorMessage("Requested length is not valid", "API Parameter Error")
-#define ErrorBadAddress()           ErrorMessage("Bad offset or length given", "API Parameter Error")
-#define ErrorNullPointer()          ErrorMessage("Data pointer provided is NULL", "API Parameter Error")
-#define ErrorBadLengthReturned()    ErrorMessage("A data read operation did not recieve the expected number of bytes")
-#define ErrorInternal()             ErrorMessage("The USB driver has reported an error", "Device Communication Error")
+DWORD CompleteRequest(HW_REQUEST *Request, BYTE Token, BYTE Count, BYTE *DataMessage);
+DWORD FailRequest(HW_REQUEST *Request);
+BYTE ListOperationSize(BYTE Remaining, BYTE *Operation, BYTE *ResultSize);
+DWORD TestCode(HW_DEVICE *Device, void *Context);
+HW_ERROR *HW_ThreadError(void);
+void HW_SetError(HW_ERROR *Error, DWORD Code, char *Detail);
+void HW_ClearError(void);
+DWORD ErrorMessage(DWORD Code, char *ErrorDescription, char *ErrorType);
+#define ErrorNoDevice()             ErrorMessage(BHPMOD_ERROR_PARAMETER, "Device not properly identified", "API Parameter Error")
+#define ErrorFileNotFound()         ErrorMessage(BHPMOD_ERROR_FILE, "Unable to open the specified file", "API Parameter Error")
+#define ErrorBadValue()             ErrorMessage(BHPMOD_ERROR_PARAMETER, "Specified value is out of range", "API Parameter Error")
+#define ErrorBadLength()            ErrorMessage(BHPMOD_ERROR_PARAMETER, "Requested length is not valid", "API Parameter Error")
+#define ErrorBadAddress()           ErrorMessage(BHPMOD_ERROR_PARAMETER, "Bad offset or length given", "API Parameter Error")
+#define ErrorNullPointer()          ErrorMessage(BHPMOD_ERROR_PARAMETER, "Data pointer provided is NULL", "API Parameter Error")
+#define ErrorBadLengthReturned()    ErrorMessage(BHPMOD_ERROR_RESPONSE, "A data read operation did not recieve the expected number of bytes", "Device Communication Error")
+#define ErrorInternal()             ErrorMessage(BHPMOD_ERROR_DRIVER, "The USB driver has reported an error", "Device Communication Error")
+#define ErrorNoResponse()           ErrorMessage(BHPMOD_ERROR_NO_RESPONSE, "The device did not respond to a command", "Device Communication Error")
+#define ErrorBadResponse()          ErrorMessage(BHPMOD_ERROR_RESPONSE, "Unexpected device response", "Device Communication Error")
+#define ErrorCommandFailed()        ErrorMessage(BHPMOD_ERROR_DEVICE, "The device reported that the command failed", "Device Error")
+#define ErrorNotReconnected()       ErrorMessage(BHPMOD_ERROR_NOT_FOUND, "The device was lost and has not been found again", "Device Not Found")
+#define ErrorNotSupported()         ErrorMessage(BHPMOD_ERROR_DEVICE, "The device firmware does not support this function", "Device Error")
 
 /* Local data definitions */
 
 // General purpose message buffer
 char UserMsg[1000];
 
-// Driver handle to the device
-HANDLE hBHPMOD = INVALID_HANDLE_VALUE;                               
+// Devices presently open, and the lock held while the list is changed
+HW_DEVICE *DeviceList = NULL;
+CRITICAL_SECTION DeviceListLock;
+
+// Device used by the functions that do not take a handle
+// This is the first device found when one of them is first used
+HW_DEVICE *DefaultDevice = NULL;
+
+// Table of attached devices, the driver device count it was built for, and its lock
+HW_TABLE_ENTRY DeviceTable[HW_MAX_DEVICES];
+DWORD DeviceTableCount = 0;
+DWORD DeviceTableDriverCount = 0xFFFFFFFF;
+CRITICAL_SECTION DeviceTableLock;
+
+// Pin number of each bit of a port command, per the PMOD_PORT_PINn definitions
+const BYTE PortPins[8] = { 1, 2, 3, 4, 7, 8, 9, 10 };
+
+// Thread local slot holding the event each application thread waits on
+DWORD ThreadEventIndex = TLS_OUT_OF_INDEXES;
+
+// Set once the process is exiting, when other threads are already gone
+BYTE ProcessDetaching = 0;
+
+// Thread local slot holding the last error of each thread
+DWORD ThreadErrorIndex = TLS_OUT_OF_INDEXES;
+
+// Error log ring and the sequence number of the last entry claimed
+HW_ERROR_ENTRY ErrorLog[HW_ERROR_LOG_SIZE];
+volatile LONG ErrorLogSequence = 0;
+
+// Application error callback, and whether errors are also shown in a dialog
+BHPMOD_ERROR_CALLBACK ErrorCallback = NULL;
+void *ErrorCallbackContext = NULL;
+BYTE ErrorDialogs = 0;
 
 /*--------------------------------------------------------------------------*/
 /* System Level Functions                                                   */
@@ -77,10 +467,20 @@ BOOL WINAPI DllMain(HINSTANCE hinstDLL, DWORD fdwReason, LPVOID lpvReserved)
    {
     /* The DLL is attaching to a process due to process initialization or a call to LoadLibrary */
     case DLL_PROCESS_ATTACH:
-     DisableThreadLibraryCalls(hinstDLL); // No need for thread attach/detach notifications.
+     // Thread detach notifications are used to free each thread's wait event and last error
      // MessageBox(NULL, "DllMain DLL_PROCESS_ATTACH", "", MB_TASKMODAL);
-     // Attempt to open the device
-     HW_Open();
+     ThreadEventIndex = TlsAlloc();
+     if(ThreadEventIndex == TLS_OUT_OF_INDEXES) return(FALSE);
+     ThreadErrorIndex = TlsAlloc();
+     if(ThreadErrorIndex == TLS_OUT_OF_INDEXES) 
+      {
+       TlsFree(ThreadEventIndex);
+       return(FALSE);
+      };
+     // Devices are opened when first used, not here, so that loading the DLL 
+     // stays quick and does not depend on a device being attached
+     InitializeCriticalSection(&DeviceListLock);
+     InitializeCriticalSection(&DeviceTableLock);
      break;
 
     /* The attached process creates a new thread */
@@ -91,12 +491,28 @@ BOOL WINAPI DllMain(HINSTANCE hinstDLL, DWORD fdwReason, LPVOID lpvReserved)
     /* The thread of the attached process terminates */
     case DLL_THREAD_DETACH:
      // MessageBox(NULL, "DllMain DLL_THREAD_DETACH", "", MB_TASKMODAL);
+     if(TlsGetValue(ThreadEventIndex) != NULL) CloseHandle((HANDLE)TlsGetValue(ThreadEventIndex));
+     free(TlsGetValue(ThreadErrorIndex));
      break;
 
     /* The DLL is detaching from a process due to process termination or a call to FreeLibrary */
     case DLL_PROCESS_DETACH:
      // MessageBox(NULL, "DllMain DLL_PROCESS_DETACH", "", MB_TASKMODAL);
-     HW_Close();
+     // Executor threads hold the DLL loaded, so devices can only still be open
+     // here if the process is exiting and the executor threads are already gone
+     // Close every device still open, however many times it was opened
+     ProcessDetaching = 1;
+     while(DeviceList != NULL)
+      {
+       DeviceList->References = 1;
+       HW_Close(DeviceList);
+      };
+     DeleteCriticalSection(&DeviceListLock);
+     DeleteCriticalSection(&DeviceTableLock);
+     if(TlsGetValue(ThreadEventIndex) != NULL) CloseHandle((HANDLE)TlsGetValue(ThreadEventIndex));
+     TlsFree(ThreadEventIndex);
+     free(TlsGetValue(ThreadErrorIndex));
+     TlsFree(ThreadErrorIndex);
      break;
 
     default:
@@ -107,42 +523,165 @@ BOOL WINAPI DllMain(HINSTANCE hinstDLL, DWORD fdwReason, LPVOID lpvReserved)
   return(TRUE);
  } 
 
+/*--------------------------------------------------------------------------*/
+/* Exported Device Functions                                                */
+/*--------------------------------------------------------------------------*/
+
+/* BHPMOD_ENUMERATE returns by reference the number of BHPMOD devices 
+   attached.  Devices are numbered from 0 up to one less than this number 
+   for BHPMOD_GetSerialNumber.  The numbering can change as devices are 
+   attached and removed, so devices should be opened by serial number.
+
+   The devices are kept in a table that is only built again when devices 
+   using the driver are attached or removed, so this is quick to call 
+   repeatedly to watch for devices coming and going.
+*/
+
+DCAPI BHPMOD_Enumerate(DWORD *NumDevices)
+ {
+  // Check arguments
+  if(NumDevices == NULL) return(0);
+
+  return(HW_Enumerate(NumDevices, 0, NULL, NULL));
+ } 
+
+/*--------------------------------------------------------------------------*/
+
+/* BHPMOD_GETSERIALNUMBER returns the serial number of the device numbered 
+   DeviceIndex as a null terminated string.  The string buffer must hold 
+   at least BHPMOD_MAX_SERIAL_LENGTH characters.
+*/
+
+DCAPI BHPMOD_GetSerialNumber(DWORD DeviceIndex, char *SerialNumber)
+ {
+  DWORD devindex;
+
+  // Check arguments
+  if(SerialNumber == NULL) return(0);
+  SerialNumber[0] = 0;
+
+  // Find the device and get its serial number
+  return(HW_Enumerate(NULL, DeviceIndex, &devindex, SerialNumber));
+ } 
+
+/*--------------------------------------------------------------------------*/
+
+/* BHPMOD_OPEN opens the device with the given serial number and returns a
+   handle to it by reference for use with the functions taking a handle.  
+   If the serial number is NULL or empty, the first device found is opened.
+   Each device is independent of the others, so different threads can each
+   work with their own device at the same time.  Opening a device that is
+   already open returns the same handle, which then needs to be closed once
+   more.  The handle should be closed by BHPMOD_Close when no longer needed.
+   The device is asked what its firmware can do as it is opened, and again
+   when it is found after a reconnect, as given by BHPMOD_GetCapabilities.
+
+   If the device is unplugged or reset while open, the handle stays valid.
+   Commands in flight at the time fail, and the next command finds the 
+   device again by its serial number and reopens it, restoring the last 
+   configuration, SPI clock phase, pin drives and pin states sent to it 
+   before going on.  Commands fail until the device is back.
+*/
+
+DCAPI BHPMOD_Open(char *SerialNumber, BHPMOD_HANDLE *Device)
+ {
+  return(HW_Open(SerialNumber, Device, 0));
+ } 
+
+/*--------------------------------------------------------------------------*/
+
+/* BHPMOD_CLOSE closes a handle returned by BHPMOD_Open.  Responses to any 
+   pipelined commands still in flight are collected first.  The handle must
+   not be used again.
+*/
+
+DCAPI BHPMOD_Close(BHPMOD_HANDLE Device)
+ {
+  return(HW_Close(Device));
+ } 
+
+/*--------------------------------------------------------------------------*/
+
+/* BHPMOD_SETSERIALNUMBER programs the serial number reported by a device so
+   that it can be told apart from others attached to the same host.  The 
+   serial number is 1 to 16 printable ASCII characters.  The device reports
+   the new serial number after it is next plugged in, so this is generally 
+   done once for each unit as it is put into service.
+*/
+
+DCAPI BHPMOD_SetSerialNumber(BHPMOD_HANDLE Device, char *SerialNumber)
+ {
+  HW_REQUEST request = { TOKEN_RESPONSE_STATUS, HW_RESPONSE_STATUS, 0, NULL, NULL };
+  size_t len;
+
+  // Check arguments
+  if(SerialNumber == NULL) return(0);
+  len = strlen(SerialNumber);
+  if((len < 1) || (len > 16)) return(0);
+
+  if(!HW_SUPPORTS(Device, CAPABILITY_BIT_SERIAL_NUMBER)) return(ErrorNotSupported());
+  return(HW_Transact(Device, TOKEN_COMMAND_SET_SERIAL_NUMBER, (BYTE)len, SerialNumber, &request));
+ } 
+
+/*--------------------------------------------------------------------------*/
+
+/* BHPMOD_GETCAPABILITIES returns what the firmware of a device reported it
+   can do when it was opened or last reconnected.  The features are the 
+   CAPABILITY_BIT values of the ICD.  The functions of this API look at them
+   themselves, using the fastest path the device has and falling back to 
+   the baseline protocol where they can, so this is only needed to find out
+   ahead of time.  Firmware older than the capabilities command reports a 
+   version of 0, no features and one command held, and 0 for the sizes and
+   rates it does not report.  No command is sent.
+*/
+
+DCAPI BHPMOD_GetCapabilities(BHPMOD_HANDLE Device, BHPMOD_CAPABILITIES *Capabilities)
+ {
+  // Check arguments
+  if(Device == NULL) return(ErrorNoDevice());
+  if(Capabilities == NULL) return(ErrorNullPointer());
+
+  *Capabilities = Device->Capabilities;
+  return(1);
+ } 
+
 /*--------------------------------------------------------------------------*/
 /* Exported Functions                                                       */
 /*--------------------------------------------------------------------------*/
 
-/* BHPMOD_GETSTATUS requests and returns the status of the device as reported
+/* BHPMOD_GETSTATUSEX requests and returns the status of the device as reported
    in a status message.  The status is returned by value as interpreted by
    the ICD.  A 1/0 pass/fail indication is returned by value.
 */
 
-DCAPI BHPMOD_GetStatus(BYTE *Status)
+DCAPI BHPMOD_GetStatusEx(BHPMOD_HANDLE Device, BYTE *Status)
  {
-  // Send the command
-  if(!HW_SendDeviceCommand(TOKEN_COMMAND_GET_STATUS, 0, NULL)) return(0);
+  HW_REQUEST request = { TOKEN_RESPONSE_STATUS, HW_RESPONSE_STATUS_VALUE, 1, NULL, Status };
+
+  // Check arguments not checked internally
+  if(Status == NULL) return(0);
 
-  // Get the response and return the status
-  return(GetStatusResponse(Status));
+  // Send the command, the response returns the status
+  return(HW_Submit(Device, TOKEN_COMMAND_GET_STATUS, 0, NULL, &request));
  } 
 
 /*--------------------------------------------------------------------------*/
 
-/* BHPMOD_SETCONFIGURATION allows the caller to establish the connectivity
+/* BHPMOD_SETCONFIGURATIONEX allows the caller to establish the connectivity
    of the PMOD connector.  This will generally affect the usability of 
    various pins, which the caller should consider separately.
 */
 
-DCAPI BHPMOD_SetConfiguration(BYTE Configuration)
+DCAPI BHPMOD_SetConfigurationEx(BHPMOD_HANDLE Device, BYTE Configuration)
  {
-  BYTE status;
-  if(!HW_SendDeviceCommand(TOKEN_COMMAND_PMOD_SET_CONFIGURATION, 1, &Configuration)) return(0);
-  GetStatusResponse(&status);
-  return((status & STATUS_BIT_ERROR) ? 0 : 1);
+  HW_REQUEST request = { TOKEN_RESPONSE_STATUS, HW_RESPONSE_STATUS, 0, NULL, NULL };
+
+  return(HW_Post(Device, TOKEN_COMMAND_PMOD_SET_CONFIGURATION, 1, &Configuration, &request));
  }
 
 /*--------------------------------------------------------------------------*/
 
-/* BHPMOD_SETPINDRIVE allows the drive configuration for as specific pin 
+/* BHPMOD_SETPINDRIVEEX allows the drive configuration for as specific pin 
    to be established as push-pull or not push-pull (1/0).  If not push-pull,
    the pin can be used as an input, passively pulled high, or driven low. 
    The call will tend to be a success, but the actual functionality may depend 
@@ -153,20 +692,19 @@ DCAPI BHPMOD_SetConfiguration(BYTE Configuration)
    end result.
 */
 
-DCAPI BHPMOD_SetPinDrive(BYTE PinNumber, BYTE PushPull)
+DCAPI BHPMOD_SetPinDriveEx(BHPMOD_HANDLE Device, BYTE PinNumber, BYTE PushPull)
  {
+  HW_REQUEST request = { TOKEN_RESPONSE_STATUS, HW_RESPONSE_STATUS, 0, NULL, NULL };
   BYTE buf[4];
-  BYTE status;
+
   buf[0] = PinNumber;
   buf[1] = PushPull;
-  if(!HW_SendDeviceCommand(TOKEN_COMMAND_PMOD_SET_PIN_DRIVE, 2, buf)) return(0);
-  GetStatusResponse(&status);
-  return((status & STATUS_BIT_ERROR) ? 0 : 1);
+  return(HW_Post(Device, TOKEN_COMMAND_PMOD_SET_PIN_DRIVE, 2, buf, &request));
  }
 
 /*--------------------------------------------------------------------------*/
 
-/* BHPMOD_SETPINSTATE allows an individual pin to be written.  The call will
+/* BHPMOD_SETPINSTATEEX allows an individual pin to be written.  The call will
    tend to be a success, but the actual functionality may depend on the 
    present configuration of the PMOD interface.
 
@@ -175,69 +713,144 @@ DCAPI BHPMOD_SetPinDrive(BYTE PinNumber, BYTE PushPull)
    end result.
 */
 
-DCAPI BHPMOD_SetPinState(BYTE PinNumber, BYTE State)
+DCAPI BHPMOD_SetPinStateEx(BHPMOD_HANDLE Device, BYTE PinNumber, BYTE State)
  {
+  HW_REQUEST request = { TOKEN_RESPONSE_STATUS, HW_RESPONSE_STATUS, 0, NULL, NULL };
   BYTE buf[4];
-  BYTE status;
+
   buf[0] = PinNumber;
   buf[1] = State;
-  if(!HW_SendDeviceCommand(TOKEN_COMMAND_PMOD_WRITE_PIN, 2, buf)) return(0);
-  GetStatusResponse(&status);
-  return((status & STATUS_BIT_ERROR) ? 0 : 1);
+  return(HW_Post(Device, TOKEN_COMMAND_PMOD_WRITE_PIN, 2, buf, &request));
  }
 
 /*--------------------------------------------------------------------------*/
 
-/* BHPMOD_GETPINSTATE retrieves the present state of a given pin.  
+/* BHPMOD_GETPINSTATEEX retrieves the present state of a given pin.  
 
 */
 
-DCAPI BHPMOD_GetPinState(BYTE PinNumber, BYTE *State)
+DCAPI BHPMOD_GetPinStateEx(BHPMOD_HANDLE Device, BYTE PinNumber, BYTE *State)
  {
-  BYTE token, cnt, val;
+  HW_REQUEST request = { TOKEN_RESPONSE_PMOD_READ_PIN, HW_RESPONSE_VALUE, 1, NULL, State };
 
   // Check arguments not checked internally
   if(State == NULL) return(0);
 
-  // Send command
-  if(!HW_SendDeviceCommand(TOKEN_COMMAND_PMOD_READ_PIN, 1, &PinNumber)) return(0);
+  // Send command, the response should be exactly the one byte pin state
+  return(HW_Submit(Device, TOKEN_COMMAND_PMOD_READ_PIN, 1, &PinNumber, &request));
+ }
 
-  // Get the response, which should be the associated response
-  cnt = 1;
-  if(!HW_GetDeviceResponse(&token, &cnt, &val)) return(ErrorInternal());
-  // If the token is something other than expected, that is a failure
-  // By the ICD, a normal command failure would return status with the error bit set
-  // Any other token would be an even more severe failure
-  // All are handled here
-  if(token != TOKEN_RESPONSE_PMOD_READ_PIN) return(0);
-  if(cnt != 1) return(0);
+/*--------------------------------------------------------------------------*/
+
+/* BHPMOD_SETPORTEX writes the state and drive configuration of any of the 
+   pins at once.  The masks and values have one bit per pin, given by the 
+   PMOD_PORT_PINn definitions in the ICD, and pins not in a mask are not 
+   affected.  The device changes all the pins together rather than one at 
+   a time, so a change across several pins has no steps in between, and a
+   pin made push-pull drives its new state from the start.  This is a 
+   write, so it is posted when posted writes are enabled.
+*/
 
-  // Return the response we got
-  *State = val;
+DCAPI BHPMOD_SetPortEx(BHPMOD_HANDLE Device, BYTE StateMask, BYTE States, BYTE DriveMask, BYTE Drives)
+ {
+  HW_REQUEST request = { TOKEN_RESPONSE_STATUS, HW_RESPONSE_STATUS, 0, NULL, NULL };
+  BYTE buf[4];
 
-  // Return success
-  return(1); 
+  buf[0] = StateMask;
+  buf[1] = States;
+  buf[2] = DriveMask;
+  buf[3] = Drives;
+  if(!HW_SUPPORTS(Device, CAPABILITY_BIT_PORT)) return(ErrorNotSupported());
+  return(HW_Post(Device, TOKEN_COMMAND_PMOD_WRITE_PORT, 4, buf, &request));
+ }
+
+/*--------------------------------------------------------------------------*/
+
+/* BHPMOD_GETPORTEX retrieves a snapshot of the device in one round trip.
+   The snapshot is BHPMOD_PORT_SIZE bytes, holding the status, the present
+   configuration, the state of every pin and the drive configuration of 
+   every pin, at the offsets defined in the API header.  The pins are one
+   bit each as for BHPMOD_SetPortEx.  This replaces a status request and a
+   pin state request per pin when polling.
+*/
+
+DCAPI BHPMOD_GetPortEx(BHPMOD_HANDLE Device, BYTE *Snapshot)
+ {
+  HW_REQUEST request = { TOKEN_RESPONSE_PMOD_READ_PORT, HW_RESPONSE_VALUE, BHPMOD_PORT_SIZE, NULL, Snapshot };
+
+  // Check arguments not checked internally
+  if(Snapshot == NULL) return(0);
+
+  // Send command, the response should be exactly the snapshot
+  if(!HW_SUPPORTS(Device, CAPABILITY_BIT_PORT)) return(ErrorNotSupported());
+  return(HW_Submit(Device, TOKEN_COMMAND_PMOD_READ_PORT, 0, NULL, &request));
  }
 
 /*--------------------------------------------------------------------------*/
 
-/* BHPMOD_SPI_SETCLOCKPHASE sets the clock to data phase relationshpi for any
+/* BHPMOD_SPI_SETCLOCKPHASEEX sets the clock to data phase relationshpi for any
    transactions on the SPI bus.  This routine can be executed anytime, but
    it is only useful when using SPI.
 */
 
-DCAPI BHPMOD_SPI_SetClockPhase(BYTE ClockPhase)
+DCAPI BHPMOD_SPI_SetClockPhaseEx(BHPMOD_HANDLE Device, BYTE ClockPhase)
  {
-  BYTE status;
+  HW_REQUEST request = { TOKEN_RESPONSE_STATUS, HW_RESPONSE_STATUS, 0, NULL, NULL };
  
-  if(!HW_SendDeviceCommand(TOKEN_COMMAND_SET_SPI_CLOCK_PHASE, 1, &ClockPhase)) return(0);
-  GetStatusResponse(&status);
-  return((status & STATUS_BIT_ERROR) ? 0 : 1);
+  return(HW_Post(Device, TOKEN_COMMAND_SET_SPI_CLOCK_PHASE, 1, &ClockPhase, &request));
+ }
+
+/*--------------------------------------------------------------------------*/
+
+/* BHPMOD_SPI_SETCLOCKRATEEX sets the clock rate in Hz for any transactions
+   on the SPI bus.  The device can only make certain rates, so the fastest
+   one not over the rate asked for is used, from 12 MHz down to about 94 KHz.
+   The default is 400 KHz.  Like the clock phase, the rate stays set when
+   the configuration is changed.  This routine can be executed anytime, but
+   it is only useful when using SPI.
+*/
+
+DCAPI BHPMOD_SPI_SetClockRateEx(BHPMOD_HANDLE Device, DWORD Rate)
+ {
+  HW_REQUEST request = { TOKEN_RESPONSE_STATUS, HW_RESPONSE_STATUS, 0, NULL, NULL };
+  DWORD divider;
+  BYTE buf[1];
+ 
+  // Check arguments
+  if(Rate == 0) return(ErrorBadValue());
+
+  // The rate is the base rate divided by one more than the divider
+  divider = ((SPI_CLOCK_BASE_RATE + Rate - 1) / Rate) - 1;
+  if(divider < 1) divider = 1;
+  if(divider > 255) divider = 255;
+  buf[0] = (BYTE)divider;
+  if(!HW_SUPPORTS(Device, CAPABILITY_BIT_SPI_TIMING)) return(ErrorNotSupported());
+  return(HW_Post(Device, TOKEN_COMMAND_SET_SPI_CLOCK_RATE, 1, buf, &request));
+ }
+
+/*--------------------------------------------------------------------------*/
+
+/* BHPMOD_SPI_SETTIMINGEX sets the chip select setup time, from chip select
+   active to the first clock, and hold time, from the last clock to chip 
+   select inactive, in uS for any transactions on the SPI bus.  The times
+   are minimums, and 0 adds no delay.  The default is 2 uS for each.  Like
+   the clock phase, the times stay set when the configuration is changed.
+*/
+
+DCAPI BHPMOD_SPI_SetTimingEx(BHPMOD_HANDLE Device, BYTE SetupTime, BYTE HoldTime)
+ {
+  HW_REQUEST request = { TOKEN_RESPONSE_STATUS, HW_RESPONSE_STATUS, 0, NULL, NULL };
+  BYTE buf[2];
+ 
+  buf[0] = SetupTime;
+  buf[1] = HoldTime;
+  if(!HW_SUPPORTS(Device, CAPABILITY_BIT_SPI_TIMING)) return(ErrorNotSupported());
+  return(HW_Post(Device, TOKEN_COMMAND_SET_SPI_TIMING, 2, buf, &request));
  }
 
 /*--------------------------------------------------------------------------*/
 
-/* BHPMOD_SPI_TRANSACTION completes a standard transaction on the local
+/* BHPMOD_SPI_TRANSACTIONEX completes a standard transaction on the local
    PMOD SPI bus using the provided data and returns the data received 
    in the same buffer. This routine allows at most 62 bytes.  The count
    is returned by reference and will differ from the count sent only if
@@ -253,10 +866,9 @@ DCAPI BHPMOD_SPI_SetClockPhase(BYTE ClockPhase)
    defined this limit somewhere.
 */
 
-DCAPI BHPMOD_SPI_Transaction(BYTE *Count, BYTE *Buffer)
+DCAPI BHPMOD_SPI_TransactionEx(BHPMOD_HANDLE Device, BYTE *Count, BYTE *Buffer)
  {
-  BYTE token, cnt;
-  BYTE buf[70];
+  HW_REQUEST request = { TOKEN_RESPONSE_SPI_TRANSACTION, HW_RESPONSE_DATA, 0, Count, Buffer };
 
   // Check arguments
   if(Buffer == NULL) return(0);
@@ -264,31 +876,96 @@ DCAPI BHPMOD_SPI_Transaction(BYTE *Count, BYTE *Buffer)
   if(*Count > 62) *Count = 62;
 
   // Send command
-  if(!HW_SendDeviceCommand(TOKEN_COMMMAND_SPI_TRANSACTION, *Count, Buffer)) { *Count = 0; return(0); };
-
-  // Get the response, which should be SPI data
+  // The response should be SPI data returned in the same buffer
   // Expected count is the same number of bytes we sent - SPI has a ring shift register nature
-  // Yet other counts might be expected if there is an error, so we want to know that and act accordingly
-  cnt = *Count;
-  if(!HW_GetDeviceResponse(&token, &cnt, buf)) { *Count = 0; return(ErrorInternal()); };
- 
-  // If the token is something other than SPI data, that is a failure
-  // By the ICD, a normal command failure would return status with the error bit set
-  // Any other token would be an even more severe failure
-  // All failures mean no data and failure response
-  if(token != TOKEN_RESPONSE_SPI_TRANSACTION) { *Count = 0; return(0); };
+  request.Limit = *Count;
+  return(HW_Submit(Device, TOKEN_COMMMAND_SPI_TRANSACTION, *Count, Buffer, &request));
+ }
+
+/*--------------------------------------------------------------------------*/
+
+/* BHPMOD_SPI_BULKTRANSACTIONEX completes a transaction on the local PMOD SPI
+   bus of any length up to 65535 bytes under one chip select.  The Count 
+   bytes of WriteContent are sent, and the bytes received at the same time
+   are returned in ReadContent.  WriteContent can be NULL to send all 0xFF,
+   ReadContent can be NULL if the data received are not wanted, and the two
+   can be the same buffer.  The data move 64 bytes per round trip with no 
+   command overhead, which suits memory dumps and display uploads.  Unlike
+   BHPMOD_SPI_TransactionEx, this fails if the PMOD is not configured for 
+   SPI.  Anything in flight is collected first.  If the transfer fails part
+   way, the device gives up on it by itself after a few seconds.  Firmware
+   without the bulk command can only do up to 62 bytes, as one ordinary 
+   transaction.
+*/
+
+DCAPI BHPMOD_SPI_BulkTransactionEx(BHPMOD_HANDLE Device, DWORD Count, BYTE *WriteContent, BYTE *ReadContent)
+ {
+  void *args[3];
+
+  // Check arguments
+  if(Count > 65535) return(ErrorBadLength());
+  if(Count == 0) return(1);
+
+  // Do the transfer on the executor thread, where no other traffic can come between its packets
+  args[0] = &Count;
+  args[1] = WriteContent;
+  args[2] = ReadContent;
+  return(HW_Call(Device, HW_SpiBulk, args));
+ }
+
+/*--------------------------------------------------------------------------*/
+
+/* BHPMOD_I2C_SETCLOCKRATEEX sets the bit rate in Hz for any transactions on
+   the I2C bus.  The device can only make certain rates, so the fastest one 
+   not over the rate asked for is used, from 400 KHz fast mode down to about
+   250 Hz.  The default is about 50 KHz, which suits every device.  The rate 
+   stays set when the configuration is changed.  This routine can be executed
+   anytime, but it is only useful when using I2C.
+*/
+
+DCAPI BHPMOD_I2C_SetClockRateEx(BHPMOD_HANDLE Device, DWORD Rate)
+ {
+  HW_REQUEST request = { TOKEN_RESPONSE_STATUS, HW_RESPONSE_STATUS, 0, NULL, NULL };
+  DWORD count;
+  BYTE buf[2];
  
-  // We got the read response
-  *Count = cnt;
-  if(cnt > 0) memcpy(Buffer, &buf, cnt);
+  // Check arguments
+  if(Rate == 0) return(ErrorBadValue());
+
+  // The rate is the base rate divided by the count
+  count = (I2C_CLOCK_BASE_RATE + Rate - 1) / Rate;
+  if(count < I2C_CLOCK_MIN_COUNT) count = I2C_CLOCK_MIN_COUNT;
+  if(count > 65535) count = 65535;
+  buf[0] = HIBYTE(count);
+  buf[1] = LOBYTE(count);
+  if(!HW_SUPPORTS(Device, CAPABILITY_BIT_I2C_TIMING)) return(ErrorNotSupported());
+  return(HW_Post(Device, TOKEN_COMMAND_SET_I2C_CLOCK_RATE, 2, buf, &request));
+ }
 
-  // Return success
-  return(1); 
+/*--------------------------------------------------------------------------*/
+
+/* BHPMOD_I2C_SETTIMEOUTEX sets the longest time in mS that any step of an 
+   I2C transaction waits, which is how long a device may stretch the clock
+   before the transaction fails.  A time of 0 sets the default of 2 seconds.
+   The time stays set when the configuration is changed.  Note that the 
+   device does nothing else while it waits, so a long time delays every 
+   other command when a device fails.
+*/
+
+DCAPI BHPMOD_I2C_SetTimeoutEx(BHPMOD_HANDLE Device, WORD Milliseconds)
+ {
+  HW_REQUEST request = { TOKEN_RESPONSE_STATUS, HW_RESPONSE_STATUS, 0, NULL, NULL };
+  BYTE buf[2];
+ 
+  buf[0] = HIBYTE(Milliseconds);
+  buf[1] = LOBYTE(Milliseconds);
+  if(!HW_SUPPORTS(Device, CAPABILITY_BIT_I2C_TIMING)) return(ErrorNotSupported());
+  return(HW_Post(Device, TOKEN_COMMAND_SET_I2C_TIMEOUT, 2, buf, &request));
  }
 
 /*--------------------------------------------------------------------------*/
 
-/* BHPMOD_I2C_WRITE translates directly to the same function on the embedded
+/* BHPMOD_I2C_WRITEEX translates directly to the same function on the embedded
    level of the BhPmod device.  The only limitation is that the subaddress if
    any is limited to two bytes, endian order change supported here for x86.  
    However, use of the subaddress is only required if a restart is required 
@@ -309,9 +986,9 @@ DCAPI BHPMOD_SPI_Transaction(BYTE *Count, BYTE *Buffer)
    Just the associated count is updated to indicate what was actually done.
 */
 
-DCAPI BHPMOD_I2C_Write(BYTE Address, BYTE SubAddrSize, void *SubAddr, BYTE *Count, void *Content)
+DCAPI BHPMOD_I2C_WriteEx(BHPMOD_HANDLE Device, BYTE Address, BYTE SubAddrSize, void *SubAddr, BYTE *Count, void *Content)
  {
-  BYTE token, cnt;
+  HW_REQUEST request = { TOKEN_RESPONSE_I2C_WRITE, HW_RESPONSE_I2C_WRITE, 0, Count, NULL };
   BYTE buf[70];
   BYTE *subaddress = (BYTE *)SubAddr;
 
@@ -323,6 +1000,7 @@ DCAPI BHPMOD_I2C_Write(BYTE Address, BYTE SubAddrSize, void *SubAddr, BYTE *Coun
   if(Content == NULL) return(0);
 
   // Send command
+  // The response will be I2C data as previously written, of which only the count is returned
   buf[0] = Address;
   buf[1] = SubAddrSize;
   buf[2] = (SubAddrSize == 1) ? subaddress[0] : 0;
@@ -330,35 +1008,19 @@ DCAPI BHPMOD_I2C_Write(BYTE Address, BYTE SubAddrSize, void *SubAddr, BYTE *Coun
   buf[3] = (SubAddrSize == 2) ? subaddress[0] : 0;
   buf[4] = *Count;
   memcpy(&buf[5], Content, *Count);
-  cnt = *Count + 5;
-  if(!HW_SendDeviceCommand(TOKEN_COMMAND_I2C_WRITE, cnt, buf)) { *Count = 0; return(0); };
-
-  // Get the response, which will be I2C data as previously written
-  if(!HW_GetDeviceResponse(&token, &cnt, &buf)) { *Count = 0; return(ErrorInternal()); };
-
-  // If the token is something other than I2C data, that is a failure
-  // By the ICD, a normal command failure would return status with the error bit set
-  // Any other token would be an even more severe failure
-  // All failures mean no data and failure response
-  if(token != TOKEN_RESPONSE_I2C_WRITE) { *Count = 0; return(0); };
-
-  // Update the count actually written based on the response
-  *Count = buf[4];
-
-  // Return success
-  return(1);
+  return(HW_Submit(Device, TOKEN_COMMAND_I2C_WRITE, *Count + 5, buf, &request));
  }
 
 /*--------------------------------------------------------------------------*/
 
-/* BHPMOD_I2C_READ translates directly to the same function on the embedded
+/* BHPMOD_I2C_READEX translates directly to the same function on the embedded
    level of the BhPmod device.  Comments are the same as for write in the dual.
    However, in this case the content read is returned.
 */
 
-DCAPI BHPMOD_I2C_Read(BYTE Address, BYTE SubAddrSize, void *SubAddr, BYTE *Count, void *Content)
+DCAPI BHPMOD_I2C_ReadEx(BHPMOD_HANDLE Device, BYTE Address, BYTE SubAddrSize, void *SubAddr, BYTE *Count, void *Content)
  {
-  BYTE token, cnt;
+  HW_REQUEST request = { TOKEN_RESPONSE_I2C_READ, HW_RESPONSE_I2C_READ, 0, Count, Content };
   BYTE buf[70];
   BYTE *subaddress = (BYTE *)SubAddr;
 
@@ -370,6 +1032,7 @@ DCAPI BHPMOD_I2C_Read(BYTE Address, BYTE SubAddrSize, void *SubAddr, BYTE *Count
   if(Content == NULL) return(0);
  
   // Send command
+  // The response will be the I2C data read with the count actually read
   buf[0] = Address;
   buf[1] = SubAddrSize;
   buf[2] = (SubAddrSize == 1) ? subaddress[0] : 0;
@@ -377,26 +1040,150 @@ DCAPI BHPMOD_I2C_Read(BYTE Address, BYTE SubAddrSize, void *SubAddr, BYTE *Count
   buf[3] = (SubAddrSize == 2) ? subaddress[0] : 0;
   buf[4] = *Count;
   memcpy(&buf[5], Content, *Count);
-  cnt = *Count + 5;
-  if(!HW_SendDeviceCommand(TOKEN_COMMAND_I2C_READ, cnt, buf)) { *Count = 0; return(0); };
+  request.Limit = *Count;
+  return(HW_Submit(Device, TOKEN_COMMAND_I2C_READ, *Count + 5, buf, &request));
+ }
 
-  // Get the response, which will be SPI data
-  if(!HW_GetDeviceResponse(&token, &cnt, &buf)) { *Count = 0; return(ErrorInternal()); };
+/*--------------------------------------------------------------------------*/
 
-  // If the token is something other than I2C data, that is a failure
-  // By the ICD, a normal command failure would return status with the error bit set
-  // Any other token would be an even more severe failure
-  // All failures mean no data and failure response
-  if(token != TOKEN_RESPONSE_I2C_READ) { *Count = 0; return(0); };
+/* BHPMOD_I2C_BULKWRITEEX writes any number of bytes up to 65535 to an I2C 
+   device, such as an EEPROM, starting at the subaddress given.  The device
+   splits the data into pieces that do not cross a boundary of PageSize, 
+   advancing the subaddress by each, and waits for the peripheral to finish
+   each piece by polling it until it acknowledges its address again.  A 
+   PageSize of 0 or over 128 is taken as 128.  The subaddress is as for 
+   BHPMOD_I2C_WriteEx.  Unlike that function, this fails if the PMOD is not
+   configured for I2C, and it fails if any piece is not fully written, in
+   which case what has been written is not known.  Anything in flight is 
+   collected first.  Firmware without the bulk command is sent ordinary 
+   writes of the same pieces instead, which needs a subaddress for more 
+   than 57 bytes, and fails if the subaddress would pass 0xFF, or 0xFFFF 
+   for a 2 byte subaddress.
+*/
 
-  // We got the read response
-  // Update the count to indicate results
-  *Count = buf[4];
-  // If there is data, go return it
-  if(*Count > 0) memcpy(Content, &buf[5], *Count);
+DCAPI BHPMOD_I2C_BulkWriteEx(BHPMOD_HANDLE Device, BYTE Address, BYTE SubAddrSize, void *SubAddr, WORD PageSize, DWORD Count, void *Content)
+ {
+  void *args[4];
+  BYTE buf[8];
+  BYTE *subaddress = (BYTE *)SubAddr;
 
-  // Return success
-  return(1);
+  // Check arguments
+  if(SubAddrSize > 2) return(ErrorBadValue());
+  if((SubAddrSize > 0) && (SubAddr == NULL)) return(ErrorNullPointer()); 
+  if(Count > 65535) return(ErrorBadLength());
+  if(Count == 0) return(1);
+  if(Content == NULL) return(ErrorNullPointer());
+
+  // The command is built here, the transfer is done on the executor thread
+  buf[0] = Address;
+  buf[1] = SubAddrSize;
+  buf[2] = (SubAddrSize == 1) ? subaddress[0] : 0;
+  if(SubAddrSize == 2) buf[2] = subaddress[1]; 
+  buf[3] = (SubAddrSize == 2) ? subaddress[0] : 0;
+  buf[4] = HIBYTE(Count);
+  buf[5] = LOBYTE(Count);
+  buf[6] = HIBYTE(PageSize);
+  buf[7] = LOBYTE(PageSize);
+  args[0] = buf;
+  args[1] = &Count;
+  args[2] = Content;
+  return(HW_Call(Device, HW_I2cBulkWrite, args));
+ }
+
+/*--------------------------------------------------------------------------*/
+
+/* BHPMOD_I2C_BULKREADEX reads any number of bytes up to 65535 from an I2C
+   device starting at the subaddress given, as one I2C transaction.  The 
+   subaddress is as for BHPMOD_I2C_ReadEx.  Unlike that function, this fails
+   if the PMOD is not configured for I2C, and it fails if the read does not
+   complete, in which case the content past the failure is 0xFF.  Anything
+   in flight is collected first.  Firmware without the bulk command is sent
+   ordinary reads of 57 bytes instead, each its own transaction, which needs
+   a subaddress for more than 57 bytes, and fails if the subaddress would 
+   pass 0xFF, or 0xFFFF for a 2 byte subaddress.
+*/
+
+DCAPI BHPMOD_I2C_BulkReadEx(BHPMOD_HANDLE Device, BYTE Address, BYTE SubAddrSize, void *SubAddr, DWORD Count, void *Content)
+ {
+  void *args[3];
+  BYTE buf[6];
+  BYTE *subaddress = (BYTE *)SubAddr;
+
+  // Check arguments
+  if(SubAddrSize > 2) return(ErrorBadValue());
+  if((SubAddrSize > 0) && (SubAddr == NULL)) return(ErrorNullPointer()); 
+  if(Count > 65535) return(ErrorBadLength());
+  if(Count == 0) return(1);
+  if(Content == NULL) return(ErrorNullPointer());
+
+  // The command is built here, the transfer is done on the executor thread
+  buf[0] = Address;
+  buf[1] = SubAddrSize;
+  buf[2] = (SubAddrSize == 1) ? subaddress[0] : 0;
+  if(SubAddrSize == 2) buf[2] = subaddress[1]; 
+  buf[3] = (SubAddrSize == 2) ? subaddress[0] : 0;
+  buf[4] = HIBYTE(Count);
+  buf[5] = LOBYTE(Count);
+  args[0] = buf;
+  args[1] = &Count;
+  args[2] = Content;
+  return(HW_Call(Device, HW_I2cBulkRead, args));
+ }
+
+/*--------------------------------------------------------------------------*/
+
+/* BHPMOD_SERIAL_SETLINEEX sets the baud rate and line format of the serial
+   port, using the SERIAL_FORMAT values of the ICD.  The device must be able
+   to make the rate within 2 percent, which allows rates from about 2000 
+   baud to well over 115200, or the function fails and nothing is changed.
+   The default is 9600,N,8,1.  Parity is sent but not checked on receive.
+   The settings stay set when the configuration is changed.
+*/
+
+DCAPI BHPMOD_SERIAL_SetLineEx(BHPMOD_HANDLE Device, DWORD BaudRate, BYTE Format)
+ {
+  HW_REQUEST request = { TOKEN_RESPONSE_STATUS, HW_RESPONSE_STATUS, 0, NULL, NULL };
+  BYTE buf[5];
+ 
+  // Check arguments
+  if(BaudRate == 0) return(ErrorBadValue());
+  if(Format > SERIAL_FORMAT_8N2) return(ErrorBadValue());
+
+  // The rate goes big endian
+  buf[0] = HIBYTE(HIWORD(BaudRate));
+  buf[1] = LOBYTE(HIWORD(BaudRate));
+  buf[2] = HIBYTE(LOWORD(BaudRate));
+  buf[3] = LOBYTE(LOWORD(BaudRate));
+  buf[4] = Format;
+  if(!HW_SUPPORTS(Device, CAPABILITY_BIT_SERIAL_LINE)) return(ErrorNotSupported());
+  return(HW_Post(Device, TOKEN_COMMAND_SET_SERIAL_LINE, 5, buf, &request));
+ }
+
+/*--------------------------------------------------------------------------*/
+
+/* BHPMOD_SERIAL_SETBUFFERSEX sets the depths of the transmit and receive 
+   buffers of the serial port on the device, which share SERIAL_BUFFER_SPACE
+   bytes.  Each buffer holds one byte less than its depth.  A deeper receive
+   buffer rides out longer gaps in reading at high baud rates, and a deeper
+   transmit buffer takes larger writes without waiting.  Any data in the 
+   buffers are lost.  The default is half of the space for each.
+*/
+
+DCAPI BHPMOD_SERIAL_SetBuffersEx(BHPMOD_HANDLE Device, WORD TxDepth, WORD RxDepth)
+ {
+  HW_REQUEST request = { TOKEN_RESPONSE_STATUS, HW_RESPONSE_STATUS, 0, NULL, NULL };
+  BYTE buf[4];
+ 
+  // Check arguments
+  if((TxDepth < 2) || (RxDepth < 2)) return(ErrorBadValue());
+  if((DWORD)TxDepth + RxDepth > SERIAL_BUFFER_SPACE) return(ErrorBadLength());
+
+  buf[0] = HIBYTE(TxDepth);
+  buf[1] = LOBYTE(TxDepth);
+  buf[2] = HIBYTE(RxDepth);
+  buf[3] = LOBYTE(RxDepth);
+  if(!HW_SUPPORTS(Device, CAPABILITY_BIT_SERIAL_LINE)) return(ErrorNotSupported());
+  return(HW_Post(Device, TOKEN_COMMAND_SET_SERIAL_BUFFERS, 4, buf, &request));
  }
 
 /*--------------------------------------------------------------------------*/
@@ -417,10 +1204,15 @@ DCAPI BHPMOD_I2C_Read(BYTE Address, BYTE SubAddrSize, void *SubAddr, BYTE *Count
    things like what happens if the string is not properly terminated or
    contains other errors.  This is the kind of thing that hackers look for 
    to attack software.  Use with care.
+
+   Each group waits for its response even when a pipeline is active, 
+   because the count written decides whether to continue.  Use 
+   BHPMOD_SERIAL_StreamEx to wait for room in the device buffer instead.
 */
 
-DCAPI BHPMOD_SERIAL_Print(char *Strz)
+DCAPI BHPMOD_SERIAL_PrintEx(BHPMOD_HANDLE Device, char *Strz)
  {
+  HW_REQUEST request = { TOKEN_RESPONSE_SERIAL_WRITE, HW_RESPONSE_COUNT, 0, NULL, NULL };
   BYTE cnt, strcnt;
   BYTE buf[70];
 
@@ -431,13 +1223,14 @@ DCAPI BHPMOD_SERIAL_Print(char *Strz)
   // Construct and send packetized version
   // Return failure if we run into trouble
   // Yes, having an absolute number for the count limit is poor form, but
-  // the only thing that cares about this is the next routine defined here only
+  // the only thing that cares about this is the serial write command 
+  request.Count = &cnt;
   strcnt = 0;
   do
    {
     cnt = 0;
     while((Strz[strcnt] != 0) && (cnt < 62)) buf[cnt++] = Strz[strcnt++];
-    if(!BHPMOD_SERIAL_Write(&cnt, buf)) return(0);
+    if(!HW_Transact(Device, TOKEN_COMMAND_SERIAL_WRITE, cnt, buf, &request)) return(0);
     if(cnt == 0) return(0);
    }
   while(Strz[strcnt] != 0);
@@ -448,6 +1241,33 @@ DCAPI BHPMOD_SERIAL_Print(char *Strz)
 
 /*--------------------------------------------------------------------------*/
 
+/* BHPMOD_SERIAL_STREAMEX sends any number of bytes to the serial port and 
+   returns once they are all in the device transmit buffer.  The device 
+   reports the free space in its buffer with each packet rather than 
+   echoing the data, so packets are sent ahead as far as that space allows
+   and the port is kept sending at its line rate.  When the buffer is full
+   this waits for it to drain, so a large count takes as long as the line 
+   rate needs.  This fails if the PMOD is not configured for serial.  
+   Anything in flight is collected first.  Firmware without the stream 
+   command is sent ordinary writes instead, one round trip each.
+*/
+
+DCAPI BHPMOD_SERIAL_StreamEx(BHPMOD_HANDLE Device, DWORD Count, BYTE *Content)
+ {
+  void *args[2];
+
+  // Check arguments
+  if(Count == 0) return(1);
+  if(Content == NULL) return(ErrorNullPointer());
+
+  // Do the transfer on the executor thread, where no other traffic can come between its packets
+  args[0] = &Count;
+  args[1] = Content;
+  return(HW_Call(Device, HW_SerialStream, args));
+ }
+
+/*--------------------------------------------------------------------------*/
+
 /* PHPMOD_SERIAL_WRITE allows a counted number of bytes to be written
    to the serial port.  This works if the PMOD is configured for serial.
    The Count returned by reference will be the number of bytes actually 
@@ -468,33 +1288,17 @@ DCAPI BHPMOD_SERIAL_Print(char *Strz)
    defined this limit somewhere.
 */
 
-DCAPI BHPMOD_SERIAL_Write(BYTE *Count, BYTE *Content)
+DCAPI BHPMOD_SERIAL_WriteEx(BHPMOD_HANDLE Device, BYTE *Count, BYTE *Content)
  {
-  BYTE token, cnt;
-  BYTE buf[70];
+  HW_REQUEST request = { TOKEN_RESPONSE_SERIAL_WRITE, HW_RESPONSE_COUNT, 0, Count, NULL };
 
   // Check arguments
   if(Count == NULL) return(0);
   if(Content == NULL) return(0);
   if(*Count > 62) *Count = 62;
 
-  // Send command
-  if(!HW_SendDeviceCommand(TOKEN_COMMAND_SERIAL_WRITE, *Count, Content)) { *Count = 0; return(0); };
-
-  // Get the response, which should be serial data
-  if(!HW_GetDeviceResponse(&token, &cnt, buf))  { *Count = 0; return(ErrorInternal()); };
-
-  // If the token is something other that serial write data, that is a failure
-  // By the ICD, a normal command failure would return status with the error bit set
-  // Any other token would be an even more severe failure
-  // All failures mean no data and failure response
-  if(token != TOKEN_RESPONSE_SERIAL_WRITE) { *Count = 0; return(0); };
-
-  // Return the resulting count
-  *Count = cnt;
-
-  // Return success
-  return(1); 
+  // Send command, the response should be the serial data written
+  return(HW_Submit(Device, TOKEN_COMMAND_SERIAL_WRITE, *Count, Content, &request));
  }
 
 /*--------------------------------------------------------------------------*/
@@ -512,317 +1316,3978 @@ DCAPI BHPMOD_SERIAL_Write(BYTE *Count, BYTE *Content)
    defined this limit somewhere.
 */
 
-DCAPI BHPMOD_SERIAL_Read(BYTE *Count, BYTE *Content)
+DCAPI BHPMOD_SERIAL_ReadEx(BHPMOD_HANDLE Device, BYTE *Count, BYTE *Content)
  {
-  BYTE token, cnt;
-  BYTE buf[70];
+  HW_REQUEST request = { TOKEN_RESPONSE_SERIAL_READ, HW_RESPONSE_DATA, 0, Count, Content };
 
   // Check arguments
   if(Count == NULL) return(0);
   if(Content == NULL) return(0);
   if(*Count > 62) *Count = 62;
  
-  // Send command
-  if(!HW_SendDeviceCommand(TOKEN_COMMAND_SERIAL_READ, *Count, Content))  { *Count = 0; return(0); };
+  // Send command, the response should be serial data
+  request.Limit = *Count;
+  return(HW_Submit(Device, TOKEN_COMMAND_SERIAL_READ, *Count, Content, &request));
+ }
 
-  // Get the response, which should be serial data
-  if(!HW_GetDeviceResponse(&token, &cnt, buf)) { *Count = 0; return(ErrorInternal()); };
+/*--------------------------------------------------------------------------*/
 
-  // If the token is something other that serial write data, that is a failure
-  // By the ICD, a normal command failure would return status with the error bit set
-  // Any other token would be an even more severe failure
-  // All failures mean no data and failure response
-  if(token != TOKEN_RESPONSE_SERIAL_READ)  { *Count = 0; return(0); };
+/* BHPMOD_SERIAL_SETEVENTSEX has the device push serial bytes to the host 
+   as they arrive, rather than waiting to be asked with BHPMOD_SERIAL_Read.
+   The device sends what it holds once it holds the threshold count, up to
+   62, or once nothing more has arrived for the idle time in mS.  A small 
+   threshold or idle time gives low latency, and a larger one fewer packets.
+   A threshold of 0 stops the pushing.  The bytes are handed to the callback
+   if one is given, which is made on the thread doing all traffic with the 
+   device, and must not call a waiting function for the same device.  The 
+   content given to the callback is only valid during the call.  Without a 
+   callback the bytes are kept until read with BHPMOD_SERIAL_WaitRead.  
+   The setting is restored after a reconnect.
+*/
 
-  // Return the resulting data
-  *Count = cnt;
-  memcpy(Content, buf, cnt);
+DCAPI BHPMOD_SERIAL_SetEventsEx(BHPMOD_HANDLE Device, BYTE Threshold, WORD IdleTime, BHPMOD_SERIAL_CALLBACK Callback, void *Context)
+ {
+  void *args[3];
+  BYTE buf[3];
 
-  // Return success
-  return(1); 
+  // Check arguments
+  if(Threshold > 62) return(ErrorBadValue());
+
+  // Firmware that cannot push bytes is never pushing them, so stopping is always fine
+  if(!HW_SUPPORTS(Device, CAPABILITY_BIT_SERIAL_EVENTS)) return((Threshold == 0) ? 1 : ErrorNotSupported());
+
+  // Change the callback and the device setting together on the executor thread
+  buf[0] = Threshold;
+  buf[1] = HIBYTE(IdleTime);
+  buf[2] = LOBYTE(IdleTime);
+  args[0] = buf;
+  args[1] = &Callback;
+  args[2] = Context;
+  return(HW_Call(Device, HW_SerialEvents, args));
  }
 
 /*--------------------------------------------------------------------------*/
-/* Exported Test Functions                                                  */
-/*--------------------------------------------------------------------------*/
 
-/* BHPMOD_TESTCODE is an undefined routine where code can be written to test 
-   various aspeBHPMOD of hardware or software.  A test number identifies one 
-   of several tests if several are defined.  Arguments are strings representing
-   unsigned long hex values so they must be at least 8 characters.  If a
+/* BHPMOD_SERIAL_WAITREADEX reads serial bytes pushed by the device since 
+   BHPMOD_SERIAL_SetEvents started it without a callback.  If none are held
+   it waits for them, up to the timeout in mS, which may be INFINITE.  The 
+   count gives the most to read and is changed to the number actually read,
+   which is 0 if the timeout passed first.  The bytes are kept until read
+   as long as the reads keep up, and otherwise the oldest are dropped.
+*/
+
+DCAPI BHPMOD_SERIAL_WaitReadEx(BHPMOD_HANDLE Device, DWORD *Count, BYTE *Content, DWORD Timeout)
+ {
+  DWORD limit, start, elapsed, i;
+
+  // Check arguments
+  if(Device == NULL) return(ErrorNoDevice());
+  if((Count == NULL) || (Content == NULL)) return(ErrorNullPointer());
+  limit = *Count;
+  *Count = 0;
+  if(limit == 0) return(1);
+
+  // Wait for bytes to be held
+  // The arrival event can be left from bytes already read, so look again after each wake
+  start = GetTickCount();
+  EnterCriticalSection(&Device->SerialLock);
+  while(Device->SerialCount == 0)
+   {
+    LeaveCriticalSection(&Device->SerialLock);
+    elapsed = GetTickCount() - start;
+    if((Timeout != INFINITE) && (elapsed >= Timeout)) return(1);
+    WaitForSingleObject(Device->SerialArrived, (Timeout == INFINITE) ? INFINITE : Timeout - elapsed);
+    EnterCriticalSection(&Device->SerialLock);
+   };
+
+  // Copy out what is held, and leave the event set for another reader if some remain
+  for(i = 0; (i < limit) && (Device->SerialCount > 0); i++)
+   {
+    Content[i] = Device->SerialRing[Device->SerialHead];
+    Device->SerialHead = (Device->SerialHead + 1) % HW_SERIAL_RING_SIZE;
+    Device->SerialCount -= 1;
+   };
+  if(Device->SerialCount > 0) SetEvent(Device->SerialArrived);
+  LeaveCriticalSection(&Device->SerialLock);
+  *Count = i;
+  return(1);
+ }
+
+/*--------------------------------------------------------------------------*/
+
+/* BHPMOD_RUNLISTEX sends a list of operations that the device runs back to 
+   back, and returns the results of all of them from the one round trip.  
+   The list is built as the ICD defines for the operation list command, up
+   to 62 bytes, and the results come back in the layout the ICD defines, so
+   a sensor poll of several dependent transactions costs one exchange.  The
+   results buffer must hold the number of bytes given by ResultCount, and 
+   the count actually returned is given back by reference.  A list that is
+   not well formed, or whose results would not fit, is not sent at all.
+   Pin writes in the list are kept for restoring after a reconnect the same
+   as those made one by one.
+*/
+
+DCAPI BHPMOD_RunListEx(BHPMOD_HANDLE Device, BYTE Count, BYTE *List, BYTE *ResultCount, BYTE *Results)
+ {
+  HW_REQUEST request = { TOKEN_RESPONSE_OPERATION_LIST, HW_RESPONSE_DATA, 0, ResultCount, Results };
+  BYTE pos, size, rsize, total;
+
+  // Check arguments
+  if((List == NULL) || (ResultCount == NULL) || (Results == NULL)) return(ErrorNullPointer());
+  if(Count > 62) return(ErrorBadLength());
+
+  // Walk the list the same way the device will, totalling the results
+  pos = 0;
+  total = 0;
+  while(pos < Count)
+   {
+    size = ListOperationSize(Count - pos, &List[pos], &rsize);
+    if(size == 0) return(ErrorBadValue());
+    if((rsize > 62 - total) || (rsize > *ResultCount - total)) return(ErrorBadLength());
+    pos += size;
+    total += rsize;
+   };
+
+  // Send command
+  // The results come back up to the total found above
+  request.Limit = total;
+  if(!HW_SUPPORTS(Device, CAPABILITY_BIT_OPERATION_LIST)) return(ErrorNotSupported());
+  return(HW_Submit(Device, TOKEN_COMMAND_OPERATION_LIST, Count, List, &request));
+ }
+
+/*--------------------------------------------------------------------------*/
+/* Exported Acquisition Functions                                           */
+/*--------------------------------------------------------------------------*/
+
+/* BHPMOD_ACQ_STARTEX gives the device a job to run on its own every period
+   in mS, so that samples are taken at an even rate without the host asking 
+   for each one.  The job is an operation list, built as for BHPMOD_RunList,
+   of up to 60 bytes, and its results are one sample, which must be no more
+   than 55 bytes.  The device keeps each sample with the time it was taken 
+   until read by BHPMOD_ACQ_Read, holding as many as fit in 512 bytes.  
+   Starting a job drops any samples held from the last one.  The job is 
+   restored after a reconnect, with its timestamps starting again from 0.
+*/
+
+DCAPI BHPMOD_ACQ_StartEx(BHPMOD_HANDLE Device, WORD Period, BYTE Count, BYTE *List)
+ {
+  BYTE buf[63];
+  BYTE pos, size, rsize, total;
+
+  // Check arguments
+  if(List == NULL) return(ErrorNullPointer());
+  if(Period == 0) return(ErrorBadValue());
+  if(Count > 60) return(ErrorBadLength());
+
+  // Walk the list the same way the device will, totalling the sample
+  pos = 0;
+  total = 0;
+  while(pos < Count)
+   {
+    size = ListOperationSize(Count - pos, &List[pos], &rsize);
+    if(size == 0) return(ErrorBadValue());
+    if(rsize > 55 - total) return(ErrorBadLength());
+    pos += size;
+    total += rsize;
+   };
+
+  // Send the job with the period in front
+  if(!HW_SUPPORTS(Device, CAPABILITY_BIT_ACQUISITION)) return(ErrorNotSupported());
+  buf[0] = HIBYTE(Period);
+  buf[1] = LOBYTE(Period);
+  memcpy(&buf[2], List, Count);
+  buf[62] = 2 + Count;
+  return(HW_Call(Device, HW_Acquisition, buf));
+ }
+
+/*--------------------------------------------------------------------------*/
+
+/* BHPMOD_ACQ_STOPEX stops the job given by BHPMOD_ACQ_Start.  Samples 
+   already taken are kept for reading.
+*/
+
+DCAPI BHPMOD_ACQ_StopEx(BHPMOD_HANDLE Device)
+ {
+  BYTE buf[63];
+
+  // Firmware that cannot run a job is never running one, so stopping is always fine
+  if(!HW_SUPPORTS(Device, CAPABILITY_BIT_ACQUISITION)) return(1);
+  buf[0] = 0;
+  buf[1] = 0;
+  buf[62] = 2;
+  return(HW_Call(Device, HW_Acquisition, buf));
+ }
+
+/*--------------------------------------------------------------------------*/
+
+/* BHPMOD_ACQ_READEX reads the samples the device has taken, oldest first, 
+   without waiting for more.  The count gives the most to read and is 
+   changed to the number actually read.  Each sample is placed in turn in 
+   the samples buffer, which must hold that many samples of the size the 
+   job gives, and the time of each is placed in the timestamps buffer, in mS
+   from the start of the job.  The number of samples the device had to drop
+   since the last read, for want of room, is given back by reference.  The
+   device is read as many times as it takes, so the caller gets everything
+   held in one call.
+*/
+
+DCAPI BHPMOD_ACQ_ReadEx(BHPMOD_HANDLE Device, DWORD *Count, DWORD *Timestamps, BYTE *Samples, DWORD *Lost)
+ {
+  void *args[4];
+
+  // Check arguments
+  if((Count == NULL) || (Timestamps == NULL) || (Samples == NULL) || (Lost == NULL)) return(ErrorNullPointer());
+  *Lost = 0;
+  if(*Count == 0) return(1);
+
+  // Read on the executor thread, which keeps the timestamps running on
+  if(!HW_SUPPORTS(Device, CAPABILITY_BIT_ACQUISITION)) return(ErrorNotSupported());
+  args[0] = Count;
+  args[1] = Timestamps;
+  args[2] = Samples;
+  args[3] = Lost;
+  return(HW_Call(Device, HW_ReadSamples, args));
+ }
+
+/*--------------------------------------------------------------------------*/
+/* Exported Streaming Functions                                             */
+/*--------------------------------------------------------------------------*/
+
+/* BHPMOD_STREAM_STARTEX has the device push the samples of the job given 
+   by BHPMOD_ACQ_Start as they are taken, so that capture carries on 
+   without the host asking at the right moment.  The device sends once it
+   holds the threshold count of samples, or a packet's worth, or once the 
+   oldest it holds is the latency in mS old.  The thread doing all traffic
+   with the device reads them as they arrive into a ring of the depth 
+   given in samples, rounded up to a power of 2, from which they are taken 
+   with BHPMOD_STREAM_Peek and BHPMOD_STREAM_Release.  Starting again 
+   drops any samples held, so nothing may be reading them at the time.  
+   BHPMOD_ACQ_Read must not be used while streaming.  The setting is 
+   restored after a reconnect.
+*/
+
+DCAPI BHPMOD_STREAM_StartEx(BHPMOD_HANDLE Device, BYTE Threshold, WORD Latency, DWORD Depth)
+ {
+  DWORD args[2];
+
+  // Check arguments
+  if(Threshold == 0) return(ErrorBadValue());
+  if((Depth == 0) || (Depth > HW_MAX_SAMPLE_DEPTH)) return(ErrorBadLength());
+
+  // Make the ring and change the device setting together on the executor thread
+  if(!HW_SUPPORTS(Device, CAPABILITY_BIT_SAMPLE_EVENTS)) return(ErrorNotSupported());
+  args[0] = MAKELONG(Latency, Threshold);
+  args[1] = Depth;
+  return(HW_Call(Device, HW_SampleEvents, args));
+ }
+
+/*--------------------------------------------------------------------------*/
+
+/* BHPMOD_STREAM_STOPEX stops the device pushing samples.  Samples already
+   kept can still be taken.
+*/
+
+DCAPI BHPMOD_STREAM_StopEx(BHPMOD_HANDLE Device)
+ {
+  DWORD args[2];
+
+  // Firmware that cannot push samples is never pushing them, so stopping is always fine
+  if(!HW_SUPPORTS(Device, CAPABILITY_BIT_SAMPLE_EVENTS)) return(1);
+  args[0] = 0;
+  args[1] = 0;
+  return(HW_Call(Device, HW_SampleEvents, args));
+ }
+
+/*--------------------------------------------------------------------------*/
+
+/* BHPMOD_STREAM_PEEKEX gives the oldest samples kept, in place in the ring,
+   without copying them.  If none are kept it waits for them, up to the 
+   timeout in mS, which may be INFINITE.  The samples are given as a 
+   pointer to the first and a count of those that follow it in order, 
+   which is 0 if the timeout passed first.  Samples kept past the end of 
+   the ring are given by the next peek.  The samples stay valid until 
+   released with BHPMOD_STREAM_Release.  Only one thread may take samples
+   from a device.
+*/
+
+DCAPI BHPMOD_STREAM_PeekEx(BHPMOD_HANDLE Device, BHPMOD_SAMPLE **Samples, DWORD *Count, DWORD Timeout)
+ {
+  DWORD start, elapsed, held, head;
+
+  // Check arguments
+  if(Device == NULL) return(ErrorNoDevice());
+  if((Samples == NULL) || (Count == NULL)) return(ErrorNullPointer());
+  *Samples = NULL;
+  *Count = 0;
+
+  // Wait for samples to be kept
+  // The arrival event can be left from samples already taken, so look again after each wake
+  start = GetTickCount();
+  while(Device->SampleTail == Device->SampleHead)
+   {
+    elapsed = GetTickCount() - start;
+    if((Timeout != INFINITE) && (elapsed >= Timeout)) return(1);
+    WaitForSingleObject(Device->SampleArrived, (Timeout == INFINITE) ? INFINITE : Timeout - elapsed);
+   };
+
+  // Give those up to the end of the ring
+  // The tail is read once, and the records before it were written before it moved
+  held = (DWORD)(Device->SampleTail - Device->SampleHead);
+  head = Device->SampleHead & Device->SampleMask;
+  if(held > Device->SampleMask + 1 - head) held = Device->SampleMask + 1 - head;
+  *Samples = &Device->SampleRing[head];
+  *Count = held;
+  return(1);
+ }
+
+/*--------------------------------------------------------------------------*/
+
+/* BHPMOD_STREAM_RELEASEEX frees the oldest samples kept, once the reader 
+   is done with those given by BHPMOD_STREAM_Peek, so their room can be 
+   used again.  The count may be any number up to the number kept.
+*/
+
+DCAPI BHPMOD_STREAM_ReleaseEx(BHPMOD_HANDLE Device, DWORD Count)
+ {
+  // Check arguments
+  if(Device == NULL) return(ErrorNoDevice());
+  if(Count > (DWORD)(Device->SampleTail - Device->SampleHead)) return(ErrorBadValue());
+
+  // The records are done with before the head moves past them
+  InterlockedExchangeAdd(&Device->SampleHead, (LONG)Count);
+  return(1);
+ }
+
+/*--------------------------------------------------------------------------*/
+
+/* BHPMOD_STREAM_GETCOUNTERSEX gives the samples lost since streaming was 
+   started.  Device lost is the count the device dropped because the host
+   did not take them fast enough, missed is the count of packets of 
+   samples that did not arrive, and host lost is the count dropped because
+   the ring was full.  Any argument may be NULL if not wanted.
+*/
+
+DCAPI BHPMOD_STREAM_GetCountersEx(BHPMOD_HANDLE Device, DWORD *DeviceLost, DWORD *Missed, DWORD *HostLost)
+ {
+  // Check arguments
+  if(Device == NULL) return(ErrorNoDevice());
+
+  if(DeviceLost != NULL) *DeviceLost = (DWORD)Device->SamplesLost;
+  if(Missed != NULL) *Missed = (DWORD)Device->SamplesMissed;
+  if(HostLost != NULL) *HostLost = (DWORD)Device->SamplesDropped;
+  return(1);
+ }
+
+/*--------------------------------------------------------------------------*/
+/* Exported Pipeline Functions                                              */
+/*--------------------------------------------------------------------------*/
+
+/* BHPMOD_PIPELINE_BEGINEX starts pipelined operation.  Until the pipeline
+   is ended, the exported device functions post their command and return
+   success immediately without waiting for the device to respond.  Up to 
+   Window commands may be in flight.  When the window is full, the oldest
+   response is collected before another command is sent.  Responses are 
+   always collected in the order the commands were posted, and the results 
+   are returned through the arguments given when the command was posted.
+   Those arguments must therefore remain valid until the response has been 
+   collected by BHPMOD_PIPELINE_Collect or BHPMOD_PIPELINE_End.  The window 
+   is limited to 16, and a window of 0 is taken as 1.
+
+   Long runs of independent reads and writes benefit the most, because 
+   the USB round trip is paid once per window rather than once per command.
+   The window is also limited to the number of commands the device reports
+   it can hold, so a larger window is quietly reduced.  The baseline 
+   firmware holds one, and later firmware holds four.
+
+   If a pipeline is already active, its responses are collected first 
+   and a 0 is returned if any of them failed.
+
+   The pipeline belongs to the thread that begins it.  Only that thread's
+   commands are posted without waiting, while other threads using the same
+   device still wait for their own responses as usual.
+*/
+
+DCAPI BHPMOD_PIPELINE_BeginEx(BHPMOD_HANDLE Device, BYTE Window)
+ {
+  DWORD args[2];
+
+  // The pipeline belongs to this thread
+  args[0] = Window;
+  args[1] = GetCurrentThreadId();
+  return(HW_Call(Device, HW_PipelineBegin, args));
+ }
+
+/*--------------------------------------------------------------------------*/
+
+/* BHPMOD_PIPELINE_COLLECTEX waits for the response to the oldest command in 
+   flight and completes it into the arguments given when it was posted.  The
+   1/0 result is what the command would have returned had it not been 
+   pipelined.  If there is nothing in flight, a 0 is returned.  The number
+   of commands still in flight is returned by reference if not NULL.
+*/
+
+DCAPI BHPMOD_PIPELINE_CollectEx(BHPMOD_HANDLE Device, DWORD *Outstanding)
+ {
+  DWORD args[1] = { 0 };
+  DWORD result;
+
+  // Collect the oldest response and return what remains
+  result = HW_Call(Device, HW_PipelineCollect, args);
+  if(Outstanding != NULL) *Outstanding = args[0];
+  return(result);
+ }
+
+/*--------------------------------------------------------------------------*/
+
+/* BHPMOD_PIPELINE_ENDEX collects all responses still in flight and returns 
+   to normal operation where each function waits for its own response.  The 
+   number of commands that failed, not counting those already reported by
+   BHPMOD_PIPELINE_Collect, is returned by reference if not NULL.  A 1 is
+   returned if there were no such failures, otherwise a 0.
+*/
+
+DCAPI BHPMOD_PIPELINE_EndEx(BHPMOD_HANDLE Device, DWORD *Failures)
+ {
+  DWORD args[1] = { 0 };
+  DWORD result;
+
+  // Collect everything in flight and return the failure count
+  result = HW_Call(Device, HW_PipelineEnd, args);
+  if(Failures != NULL) *Failures = args[0];
+  return(result);
+ }
+
+/*--------------------------------------------------------------------------*/
+
+/* BHPMOD_SETSEQUENCINGEX turns sequence numbers on or off for a device.  With
+   sequence numbers on, each command carries a number that the device sends
+   back with its response, so a response is never taken for that of another
+   command.  A response that comes too late for its command is discarded 
+   when it arrives, rather than throwing every later response out of step, 
+   and a response that never comes is found as soon as a later one arrives,
+   rather than after the response timeout.  This also makes windows larger
+   than 1 safe to try, since a command the device drops fails by itself.
+
+   Commands with the full 62 data bytes have no room for a number, so they
+   are sent without one as before.  Turning sequence numbers on first asks
+   the device whether it supports them, and a 0 is returned if it does not,
+   in which case they stay off.  Anything in flight is collected first.
+*/
+
+DCAPI BHPMOD_SetSequencingEx(BHPMOD_HANDLE Device, BYTE Enable)
+ {
+  DWORD args[1];
+
+  args[0] = Enable;
+  return(HW_Call(Device, HW_Sequencing, args));
+ }
+
+/*--------------------------------------------------------------------------*/
+/* Exported Posted And Combined Write Functions                             */
+/*--------------------------------------------------------------------------*/
+
+/* BHPMOD_SETPOSTEDWRITESEX turns posted writes on or off for a device.  
+   With posted writes on, BHPMOD_SetConfiguration, BHPMOD_SetPinDrive, 
+   BHPMOD_SetPinState and the BHPMOD_SPI_Set, BHPMOD_I2C_Set and 
+   BHPMOD_SERIAL_Set functions return a 1 as soon as the command is 
+   queued, without waiting for the status response, which almost never
+   reports an error.  The status is checked as it arrives, 
+   and the first failure is held for the device.  The next function that 
+   waits on the device then returns a 0 with BHPMOD_ERROR_POSTED as its 
+   last error, even though it was itself carried out, and the failure is 
+   cleared.  Commands are still sent in the order they were called, so a 
+   function that reads back sees the effect of every write before it.  
+   Turning posted writes off waits for those in flight and returns a 0 if
+   any failed, as BHPMOD_FenceEx does.
+*/
+
+DCAPI BHPMOD_SetPostedWritesEx(BHPMOD_HANDLE Device, BYTE Enable)
+ {
+  DWORD args[1];
+
+  args[0] = Enable;
+  return(HW_Call(Device, HW_PostedWrites, args));
+ }
+
+/*--------------------------------------------------------------------------*/
+
+/* BHPMOD_FENCEEX waits until every command already queued for the device 
+   has finished.  A 0 is returned if a posted write failed since the last
+   time a failure was reported, with BHPMOD_ERROR_POSTED as the last error,
+   otherwise a 1.
+*/
+
+DCAPI BHPMOD_FenceEx(BHPMOD_HANDLE Device)
+ {
+  return(HW_Call(Device, HW_Fence, NULL));
+ }
+
+/*--------------------------------------------------------------------------*/
+
+/* BHPMOD_SETWRITECOMBININGEX turns write combining on or off for a device.
+   With write combining on, BHPMOD_SetPinState and BHPMOD_SetPinDrive 
+   return a 1 straight away and the write is held for a couple of mS.  A 
+   later write to the same pin replaces it, and a write that would not 
+   change what was last sent to the pin is dropped, so a burst of pin 
+   changes goes out as the fewest commands, back to back.  The held writes
+   are sent when they fall due, when BHPMOD_FlushEx is called, or before 
+   any other command for the device, so a function that reads back always
+   sees them.  They are posted writes, so a failure is reported by a later
+   call as described for BHPMOD_SetPostedWritesEx.  Turning write combining
+   off sends anything held.
+*/
+
+DCAPI BHPMOD_SetWriteCombiningEx(BHPMOD_HANDLE Device, BYTE Enable)
+ {
+  DWORD args[1];
+
+  args[0] = Enable;
+  return(HW_Call(Device, HW_WriteCombining, args));
+ }
+
+/*--------------------------------------------------------------------------*/
+
+/* BHPMOD_FLUSHEX sends the pin writes held for combining without waiting 
+   for them to fall due.  It does not wait for their responses.
+*/
+
+DCAPI BHPMOD_FlushEx(BHPMOD_HANDLE Device)
+ {
+  return(HW_Call(Device, HW_Flush, NULL));
+ }
+
+/*--------------------------------------------------------------------------*/
+/* Exported Asynchronous Functions                                          */
+/*--------------------------------------------------------------------------*/
+
+/* The following functions queue the same command as the corresponding 
+   function taking a handle, but return straight away without waiting for 
+   the device.  A 1 is returned if the command was queued, in which case 
+   the callback is made exactly once when it has finished.  The callback 
+   is given the device, the 1/0 result the waiting function would have 
+   returned, and the context given here.  A 0 is returned if the command 
+   could not be queued, and then no callback is made.
+
+   Results are returned through the arguments given here just before the 
+   callback is made, so those arguments must remain valid until then.  
+   Commands on a device are sent in the order they were queued.  As many
+   are in flight at once as the pipeline window allows (see 
+   BHPMOD_PIPELINE_Begin), otherwise they go one at a time.  No thread 
+   waits on any of them, so any number can be queued across any number 
+   of devices.
+
+   The callback is made on the thread that does all traffic with the 
+   device.  It should return promptly and must not call a waiting function 
+   for the same device, which would never finish.  It may queue more 
+   asynchronous commands.
+*/
+
+DCAPI BHPMOD_SetPinStateAsync(BHPMOD_HANDLE Device, BYTE PinNumber, BYTE State, BHPMOD_CALLBACK Callback, void *Context)
+ {
+  HW_REQUEST request = { TOKEN_RESPONSE_STATUS, HW_RESPONSE_STATUS, 0, NULL, NULL };
+  BYTE buf[4];
+
+  buf[0] = PinNumber;
+  buf[1] = State;
+  return(HW_SubmitAsync(Device, TOKEN_COMMAND_PMOD_WRITE_PIN, 2, buf, &request, Callback, Context));
+ }
+
+DCAPI BHPMOD_GetPinStateAsync(BHPMOD_HANDLE Device, BYTE PinNumber, BYTE *State, BHPMOD_CALLBACK Callback, void *Context)
+ {
+  HW_REQUEST request = { TOKEN_RESPONSE_PMOD_READ_PIN, HW_RESPONSE_VALUE, 1, NULL, State };
+
+  // Check arguments not checked internally
+  if(State == NULL) return(0);
+
+  return(HW_SubmitAsync(Device, TOKEN_COMMAND_PMOD_READ_PIN, 1, &PinNumber, &request, Callback, Context));
+ }
+
+DCAPI BHPMOD_SPI_TransactionAsync(BHPMOD_HANDLE Device, BYTE *Count, BYTE *Buffer, BHPMOD_CALLBACK Callback, void *Context)
+ {
+  HW_REQUEST request = { TOKEN_RESPONSE_SPI_TRANSACTION, HW_RESPONSE_DATA, 0, Count, Buffer };
+
+  // Check arguments
+  if(Buffer == NULL) return(0);
+  if(Count == NULL) return(0);
+  if(*Count > 62) *Count = 62;
+
+  // The response is SPI data returned in the same buffer
+  request.Limit = *Count;
+  return(HW_SubmitAsync(Device, TOKEN_COMMMAND_SPI_TRANSACTION, *Count, Buffer, &request, Callback, Context));
+ }
+
+DCAPI BHPMOD_I2C_WriteAsync(BHPMOD_HANDLE Device, BYTE Address, BYTE SubAddrSize, void *SubAddr, BYTE *Count, void *Content, BHPMOD_CALLBACK Callback, void *Context)
+ {
+  HW_REQUEST request = { TOKEN_RESPONSE_I2C_WRITE, HW_RESPONSE_I2C_WRITE, 0, Count, NULL };
+  BYTE buf[70];
+  BYTE *subaddress = (BYTE *)SubAddr;
+
+  // Check arguments
+  if(SubAddrSize > 2) return(0);
+  if((SubAddrSize > 0) && (SubAddr == NULL)) return(0); 
+  if(Count == NULL) return(0);
+  if(*Count > 57) return(0);
+  if(Content == NULL) return(0);
+
+  // The response count is returned, the data written are not
+  buf[0] = Address;
+  buf[1] = SubAddrSize;
+  buf[2] = (SubAddrSize == 1) ? subaddress[0] : 0;
+  if(SubAddrSize == 2) buf[2] = subaddress[1]; 
+  buf[3] = (SubAddrSize == 2) ? subaddress[0] : 0;
+  buf[4] = *Count;
+  memcpy(&buf[5], Content, *Count);
+  return(HW_SubmitAsync(Device, TOKEN_COMMAND_I2C_WRITE, *Count + 5, buf, &request, Callback, Context));
+ }
+
+DCAPI BHPMOD_I2C_ReadAsync(BHPMOD_HANDLE Device, BYTE Address, BYTE SubAddrSize, void *SubAddr, BYTE *Count, void *Content, BHPMOD_CALLBACK Callback, void *Context)
+ {
+  HW_REQUEST request = { TOKEN_RESPONSE_I2C_READ, HW_RESPONSE_I2C_READ, 0, Count, Content };
+  BYTE buf[70];
+  BYTE *subaddress = (BYTE *)SubAddr;
+
+  // Check arguments
+  if(SubAddrSize > 2) return(0);
+  if((SubAddrSize > 0) && (SubAddr == NULL)) return(0); 
+  if(Count == NULL) return(0);
+  if(*Count > 57) return(0);
+  if(Content == NULL) return(0);
+ 
+  // The response is the I2C data read with the count actually read
+  buf[0] = Address;
+  buf[1] = SubAddrSize;
+  buf[2] = (SubAddrSize == 1) ? subaddress[0] : 0;
+  if(SubAddrSize == 2) buf[2] = subaddress[1]; 
+  buf[3] = (SubAddrSize == 2) ? subaddress[0] : 0;
+  buf[4] = *Count;
+  memcpy(&buf[5], Content, *Count);
+  request.Limit = *Count;
+  return(HW_SubmitAsync(Device, TOKEN_COMMAND_I2C_READ, *Count + 5, buf, &request, Callback, Context));
+ }
+
+DCAPI BHPMOD_SERIAL_WriteAsync(BHPMOD_HANDLE Device, BYTE *Count, BYTE *Content, BHPMOD_CALLBACK Callback, void *Context)
+ {
+  HW_REQUEST request = { TOKEN_RESPONSE_SERIAL_WRITE, HW_RESPONSE_COUNT, 0, Count, NULL };
+
+  // Check arguments
+  if(Count == NULL) return(0);
+  if(Content == NULL) return(0);
+  if(*Count > 62) *Count = 62;
+
+  return(HW_SubmitAsync(Device, TOKEN_COMMAND_SERIAL_WRITE, *Count, Content, &request, Callback, Context));
+ }
+
+DCAPI BHPMOD_SERIAL_ReadAsync(BHPMOD_HANDLE Device, BYTE *Count, BYTE *Content, BHPMOD_CALLBACK Callback, void *Context)
+ {
+  HW_REQUEST request = { TOKEN_RESPONSE_SERIAL_READ, HW_RESPONSE_DATA, 0, Count, Content };
+
+  // Check arguments
+  if(Count == NULL) return(0);
+  if(Content == NULL) return(0);
+  if(*Count > 62) *Count = 62;
+ 
+  request.Limit = *Count;
+  return(HW_SubmitAsync(Device, TOKEN_COMMAND_SERIAL_READ, *Count, Content, &request, Callback, Context));
+ }
+
+/*--------------------------------------------------------------------------*/
+/* Exported Default Device Functions                                        */
+/*--------------------------------------------------------------------------*/
+
+/* The following functions are the original forms of the functions above 
+   without a handle.  Each does the same as the corresponding function 
+   taking a handle, applied to the first device found.  That device is 
+   opened when one of them is first used, and if none is attached they 
+   fail quietly and look again next time.  These suit applications that 
+   only ever use one device.
+*/
+
+DCAPI BHPMOD_GetStatus(BYTE *Status)
+ {
+  return(BHPMOD_GetStatusEx(HW_DefaultDevice(), Status));
+ }
+
+DCAPI BHPMOD_SetConfiguration(BYTE Configuration)
+ {
+  return(BHPMOD_SetConfigurationEx(HW_DefaultDevice(), Configuration));
+ }
+
+DCAPI BHPMOD_SetPinDrive(BYTE PinNumber, BYTE PushPull)
+ {
+  return(BHPMOD_SetPinDriveEx(HW_DefaultDevice(), PinNumber, PushPull));
+ }
+
+DCAPI BHPMOD_SetPinState(BYTE PinNumber, BYTE State)
+ {
+  return(BHPMOD_SetPinStateEx(HW_DefaultDevice(), PinNumber, State));
+ }
+
+DCAPI BHPMOD_GetPinState(BYTE PinNumber, BYTE *State)
+ {
+  return(BHPMOD_GetPinStateEx(HW_DefaultDevice(), PinNumber, State));
+ }
+
+DCAPI BHPMOD_SetPort(BYTE StateMask, BYTE States, BYTE DriveMask, BYTE Drives)
+ {
+  return(BHPMOD_SetPortEx(HW_DefaultDevice(), StateMask, States, DriveMask, Drives));
+ }
+
+DCAPI BHPMOD_GetPort(BYTE *Snapshot)
+ {
+  return(BHPMOD_GetPortEx(HW_DefaultDevice(), Snapshot));
+ }
+
+DCAPI BHPMOD_SPI_SetClockPhase(BYTE ClockPhase)
+ {
+  return(BHPMOD_SPI_SetClockPhaseEx(HW_DefaultDevice(), ClockPhase));
+ }
+
+DCAPI BHPMOD_SPI_SetClockRate(DWORD Rate)
+ {
+  return(BHPMOD_SPI_SetClockRateEx(HW_DefaultDevice(), Rate));
+ }
+
+DCAPI BHPMOD_SPI_SetTiming(BYTE SetupTime, BYTE HoldTime)
+ {
+  return(BHPMOD_SPI_SetTimingEx(HW_DefaultDevice(), SetupTime, HoldTime));
+ }
+
+DCAPI BHPMOD_SPI_Transaction(BYTE *Count, BYTE *Buffer)
+ {
+  return(BHPMOD_SPI_TransactionEx(HW_DefaultDevice(), Count, Buffer));
+ }
+
+DCAPI BHPMOD_SPI_BulkTransaction(DWORD Count, BYTE *WriteContent, BYTE *ReadContent)
+ {
+  return(BHPMOD_SPI_BulkTransactionEx(HW_DefaultDevice(), Count, WriteContent, ReadContent));
+ }
+
+DCAPI BHPMOD_I2C_SetClockRate(DWORD Rate)
+ {
+  return(BHPMOD_I2C_SetClockRateEx(HW_DefaultDevice(), Rate));
+ }
+
+DCAPI BHPMOD_I2C_SetTimeout(WORD Milliseconds)
+ {
+  return(BHPMOD_I2C_SetTimeoutEx(HW_DefaultDevice(), Milliseconds));
+ }
+
+DCAPI BHPMOD_I2C_Write(BYTE Address, BYTE SubAddrSize, void *SubAddr, BYTE *Count, void *Content)
+ {
+  return(BHPMOD_I2C_WriteEx(HW_DefaultDevice(), Address, SubAddrSize, SubAddr, Count, Content));
+ }
+
+DCAPI BHPMOD_I2C_Read(BYTE Address, BYTE SubAddrSize, void *SubAddr, BYTE *Count, void *Content)
+ {
+  return(BHPMOD_I2C_ReadEx(HW_DefaultDevice(), Address, SubAddrSize, SubAddr, Count, Content));
+ }
+
+DCAPI BHPMOD_I2C_BulkWrite(BYTE Address, BYTE SubAddrSize, void *SubAddr, WORD PageSize, DWORD Count, void *Content)
+ {
+  return(BHPMOD_I2C_BulkWriteEx(HW_DefaultDevice(), Address, SubAddrSize, SubAddr, PageSize, Count, Content));
+ }
+
+DCAPI BHPMOD_I2C_BulkRead(BYTE Address, BYTE SubAddrSize, void *SubAddr, DWORD Count, void *Content)
+ {
+  return(BHPMOD_I2C_BulkReadEx(HW_DefaultDevice(), Address, SubAddrSize, SubAddr, Count, Content));
+ }
+
+DCAPI BHPMOD_SERIAL_SetLine(DWORD BaudRate, BYTE Format)
+ {
+  return(BHPMOD_SERIAL_SetLineEx(HW_DefaultDevice(), BaudRate, Format));
+ }
+
+DCAPI BHPMOD_SERIAL_SetBuffers(WORD TxDepth, WORD RxDepth)
+ {
+  return(BHPMOD_SERIAL_SetBuffersEx(HW_DefaultDevice(), TxDepth, RxDepth));
+ }
+
+DCAPI BHPMOD_SERIAL_Print(char *Strz)
+ {
+  return(BHPMOD_SERIAL_PrintEx(HW_DefaultDevice(), Strz));
+ }
+
+DCAPI BHPMOD_SERIAL_Stream(DWORD Count, BYTE *Content)
+ {
+  return(BHPMOD_SERIAL_StreamEx(HW_DefaultDevice(), Count, Content));
+ }
+
+DCAPI BHPMOD_SERIAL_Write(BYTE *Count, BYTE *Content)
+ {
+  return(BHPMOD_SERIAL_WriteEx(HW_DefaultDevice(), Count, Content));
+ }
+
+DCAPI BHPMOD_SERIAL_Read(BYTE *Count, BYTE *Content)
+ {
+  return(BHPMOD_SERIAL_ReadEx(HW_DefaultDevice(), Count, Content));
+ }
+
+DCAPI BHPMOD_SERIAL_SetEvents(BYTE Threshold, WORD IdleTime, BHPMOD_SERIAL_CALLBACK Callback, void *Context)
+ {
+  return(BHPMOD_SERIAL_SetEventsEx(HW_DefaultDevice(), Threshold, IdleTime, Callback, Context));
+ }
+
+DCAPI BHPMOD_SERIAL_WaitRead(DWORD *Count, BYTE *Content, DWORD Timeout)
+ {
+  return(BHPMOD_SERIAL_WaitReadEx(HW_DefaultDevice(), Count, Content, Timeout));
+ }
+
+DCAPI BHPMOD_RunList(BYTE Count, BYTE *List, BYTE *ResultCount, BYTE *Results)
+ {
+  return(BHPMOD_RunListEx(HW_DefaultDevice(), Count, List, ResultCount, Results));
+ }
+
+DCAPI BHPMOD_ACQ_Start(WORD Period, BYTE Count, BYTE *List)
+ {
+  return(BHPMOD_ACQ_StartEx(HW_DefaultDevice(), Period, Count, List));
+ }
+
+DCAPI BHPMOD_ACQ_Stop(void)
+ {
+  return(BHPMOD_ACQ_StopEx(HW_DefaultDevice()));
+ }
+
+DCAPI BHPMOD_ACQ_Read(DWORD *Count, DWORD *Timestamps, BYTE *Samples, DWORD *Lost)
+ {
+  return(BHPMOD_ACQ_ReadEx(HW_DefaultDevice(), Count, Timestamps, Samples, Lost));
+ }
+
+DCAPI BHPMOD_STREAM_Start(BYTE Threshold, WORD Latency, DWORD Depth)
+ {
+  return(BHPMOD_STREAM_StartEx(HW_DefaultDevice(), Threshold, Latency, Depth));
+ }
+
+DCAPI BHPMOD_STREAM_Stop(void)
+ {
+  return(BHPMOD_STREAM_StopEx(HW_DefaultDevice()));
+ }
+
+DCAPI BHPMOD_STREAM_Peek(BHPMOD_SAMPLE **Samples, DWORD *Count, DWORD Timeout)
+ {
+  return(BHPMOD_STREAM_PeekEx(HW_DefaultDevice(), Samples, Count, Timeout));
+ }
+
+DCAPI BHPMOD_STREAM_Release(DWORD Count)
+ {
+  return(BHPMOD_STREAM_ReleaseEx(HW_DefaultDevice(), Count));
+ }
+
+DCAPI BHPMOD_STREAM_GetCounters(DWORD *DeviceLost, DWORD *Missed, DWORD *HostLost)
+ {
+  return(BHPMOD_STREAM_GetCountersEx(HW_DefaultDevice(), DeviceLost, Missed, HostLost));
+ }
+
+DCAPI BHPMOD_PIPELINE_Begin(BYTE Window)
+ {
+  return(BHPMOD_PIPELINE_BeginEx(HW_DefaultDevice(), Window));
+ }
+
+DCAPI BHPMOD_PIPELINE_Collect(DWORD *Outstanding)
+ {
+  return(BHPMOD_PIPELINE_CollectEx(HW_DefaultDevice(), Outstanding));
+ }
+
+DCAPI BHPMOD_PIPELINE_End(DWORD *Failures)
+ {
+  return(BHPMOD_PIPELINE_EndEx(HW_DefaultDevice(), Failures));
+ }
+
+DCAPI BHPMOD_SetSequencing(BYTE Enable)
+ {
+  return(BHPMOD_SetSequencingEx(HW_DefaultDevice(), Enable));
+ }
+
+DCAPI BHPMOD_SetPostedWrites(BYTE Enable)
+ {
+  return(BHPMOD_SetPostedWritesEx(HW_DefaultDevice(), Enable));
+ }
+
+DCAPI BHPMOD_Fence(void)
+ {
+  return(BHPMOD_FenceEx(HW_DefaultDevice()));
+ }
+
+DCAPI BHPMOD_SetWriteCombining(BYTE Enable)
+ {
+  return(BHPMOD_SetWriteCombiningEx(HW_DefaultDevice(), Enable));
+ }
+
+DCAPI BHPMOD_Flush(void)
+ {
+  return(BHPMOD_FlushEx(HW_DefaultDevice()));
+ }
+
+/*--------------------------------------------------------------------------*/
+/* Exported Error Functions                                                 */
+/*--------------------------------------------------------------------------*/
+
+/* Errors are not shown to the user unless dialogs are enabled.  Instead,
+   each error is kept as the last error of the thread that called the
+   failing function, written to an error log that any thread can read, and
+   passed to the error callback if one is set.  A failing function leaves
+   its last error on the calling thread even when the error was found by the
+   thread doing the traffic with the device.  An asynchronous callback for
+   a failure can read the error by BHPMOD_GetLastError too.  As with the
+   Windows last error, the last error only means something straight after
+   a function has failed.
+*/
+
+/* BHPMOD_GETLASTERROR returns by reference the code and detail string of
+   the last error recorded for the calling thread.  The detail is cut short
+   to fit the size given, and may be NULL if only the code is wanted.
+*/
+
+DCAPI BHPMOD_GetLastError(DWORD *Code, char *Detail, DWORD Size)
+ {
+  HW_ERROR *error = HW_ThreadError();
+
+  // Check arguments
+  if(Code == NULL) return(0);
+  if(error == NULL) return(0);
+
+  *Code = error->Code;
+  if((Detail != NULL) && (Size > 0))
+   {
+    Detail[0] = 0;
+    strncat(Detail, error->Detail, Size - 1);
+   };
+  return(1);
+ }
+
+/*--------------------------------------------------------------------------*/
+
+/* BHPMOD_READERRORLOG reads an entry from the error log, which holds the
+   last 64 errors recorded by any thread.  Entries are numbered in the order
+   recorded starting at 1.  Sequence gives the number of the entry wanted
+   and is returned as the number of the entry after the one read, so that
+   starting at 0 and calling until a 0 is returned reads the whole log, and
+   calling again later reads only what has been recorded since.  If the
+   entry wanted has already been overwritten, the oldest entry held is read
+   instead, so a jump in the sequence shows that errors were missed.  The
+   code and detail are returned as for BHPMOD_GetLastError.  Reading never
+   holds up threads recording errors.
+*/
+
+DCAPI BHPMOD_ReadErrorLog(DWORD *Sequence, DWORD *Code, char *Detail, DWORD Size)
+ {
+  HW_ERROR_ENTRY *entry;
+  HW_ERROR error;
+  LONG last, wanted;
+
+  // Check arguments
+  if(Sequence == NULL) return(0);
+  if(Code == NULL) return(0);
+
+  // Copy the entry wanted, or the oldest held
+  // An entry being written meanwhile is copied again once it is whole
+  while(1)
+   {
+    last = ErrorLogSequence;
+    wanted = (*Sequence == 0) ? 1 : (LONG)*Sequence;
+    if(wanted > last) return(0);
+    if(last - wanted >= HW_ERROR_LOG_SIZE) wanted = last - HW_ERROR_LOG_SIZE + 1;
+    entry = &ErrorLog[(DWORD)wanted % HW_ERROR_LOG_SIZE];
+    if(entry->Sequence == wanted)
+     {
+      error = entry->Error;
+      MemoryBarrier();
+      if(entry->Sequence == wanted) break;
+     };
+    YieldProcessor();
+   };
+
+  // Return the entry
+  *Sequence = (DWORD)wanted + 1;
+  *Code = error.Code;
+  if((Detail != NULL) && (Size > 0))
+   {
+    Detail[0] = 0;
+    strncat(Detail, error.Detail, Size - 1);
+   };
+  return(1);
+ }
+
+/*--------------------------------------------------------------------------*/
+
+/* BHPMOD_SETERRORCALLBACK sets a function to be called with each error as
+   it is recorded, or none if the callback is NULL.  The callback is made on
+   the thread that found the error, which may be the thread doing the
+   traffic with a device, so it should return promptly and must not call
+   any function of this API other than the error functions.  The callback
+   should be set before devices are in use.
+*/
+
+DCAPI BHPMOD_SetErrorCallback(BHPMOD_ERROR_CALLBACK Callback, void *Context)
+ {
+  ErrorCallbackContext = Context;
+  ErrorCallback = Callback;
+  return(1);
+ }
+
+/*--------------------------------------------------------------------------*/
+
+/* BHPMOD_ENABLEDIALOGS sets whether each error is also shown to the user
+   in a task modal dialog, as the API always used to do.  Dialogs are off
+   until enabled.  They suit interactive tools, but stall the thread that
+   found the error until dismissed, and with it every thread waiting on
+   the same device.
+*/
+
+DCAPI BHPMOD_EnableDialogs(BYTE Enable)
+ {
+  ErrorDialogs = Enable ? 1 : 0;
+  return(1);
+ }
+
+/*--------------------------------------------------------------------------*/
+
+/* BHPMOD_REPORTERROR records an error found by a library built on this API,
+   such as the Fipsy loader, so that it is reported in the same way as the
+   errors of the API itself.  The caption is used only for a dialog.  A 0
+   is returned for convenience, as the failing function would return.
+*/
+
+DCAPI BHPMOD_ReportError(DWORD Code, char *Detail, char *Caption)
+ {
+  return(ErrorMessage(Code, Detail, (Caption != NULL) ? Caption : (char *)"BackHauler PMOD Error"));
+ }
+
+/*--------------------------------------------------------------------------*/
+/* Exported Test Functions                                                  */
+/*--------------------------------------------------------------------------*/
+
+/* BHPMOD_TESTCODE is an undefined routine where code can be written to test 
+   various aspeBHPMOD of hardware or software.  A test number identifies one 
+   of several tests if several are defined.  Arguments are strings representing
+   unsigned long hex values so they must be at least 8 characters.  If a
    string is not needed, it may be NULL and its value will be 0.  If a string 
    is present, a full 8 characters will be written to it on return representing
    its ending value.
 */
 
-DCAPI BHPMOD_TestCode(BYTE TestNumber, char *ArgStr1, char *ArgStr2)
+DCAPI BHPMOD_TestCode(BYTE TestNumber, char *ArgStr1, char *ArgStr2)
+ {
+  DWORD args[3];
+
+  // MessageBox(NULL, "BHPMOD_TestCode", "", MB_TASKMODAL);
+
+  // Get values in arguments
+  args[0] = TestNumber;
+  if(ArgStr1 == NULL) args[1] = 0; else sscanf(ArgStr1, "%08X", &args[1]);
+  if(ArgStr2 == NULL) args[2] = 0; else sscanf(ArgStr2, "%08X", &args[2]);
+
+  // Do the prescribed test on the executor thread so that raw test traffic
+  // is not mixed with traffic from other threads
+  HW_Call(HW_DefaultDevice(), TestCode, args);
+
+  // Write back given arguments
+  if(ArgStr1 != NULL) sprintf(ArgStr1, "%08X", args[1]);
+  if(ArgStr2 != NULL) sprintf(ArgStr2, "%08X", args[2]);
+
+  // Return success
+  return(1);
+ }
+
+/*--------------------------------------------------------------------------*/
+/* Hardware Support Functions                                               */
+/*--------------------------------------------------------------------------*/
+
+/* HW_REFRESHTABLE builds the device table again if the number of devices 
+   using the driver has changed since it was built, or always if Force is
+   set.  Only the devices with the BHPMOD vendor and product IDs are listed.
+   The table lock must be held.  A 1/0 pass/fail result is returned.
+*/
+
+DWORD HW_RefreshTable(BYTE Force)
+ {
+  DWORD NumDriverDevices, devindex;
+  WORD deviceid;
+  BYTE device_found;
+  char devidstr[SI_MAX_DEVICE_STRLEN];
+  SI_STATUS status;
+
+  // Get the number of devices on the bus which use this driver
+  status = SI_GetNumDevices(&NumDriverDevices);
+  if(status != SI_SUCCESS) 
+   {
+    DeviceTableCount = 0;
+    DeviceTableDriverCount = 0xFFFFFFFF;
+    return(0);
+   };
+
+  // Keep the table unless something has changed
+  if(!Force && (NumDriverDevices == DeviceTableDriverCount)) return(1);
+
+  // Look for each BHPMOD in the group
+  DeviceTableCount = 0;
+  for(devindex=0;(devindex<NumDriverDevices)&&(DeviceTableCount<HW_MAX_DEVICES);devindex++)
+   {
+    device_found = 1;
+    // Get and match the VID of a device
+    SI_GetProductString(devindex, devidstr, SI_RETURN_VID);
+    sscanf(devidstr, "%hX", &deviceid);
+    if(deviceid != BHPMOD_VENDOR_ID) device_found = 0;
+    // Get and match the PID of a device
+    SI_GetProductString(devindex, devidstr, SI_RETURN_PID);
+    sscanf(devidstr, "%hX", &deviceid);
+    if(deviceid != BHPMOD_PRODUCT_ID) device_found = 0;
+    if(!device_found) continue;
+
+    // List it with its serial number
+    status = SI_GetProductString(devindex, DeviceTable[DeviceTableCount].SerialNumber, SI_RETURN_SERIAL_NUMBER);
+    if(status != SI_SUCCESS) continue;
+    DeviceTable[DeviceTableCount].DriverIndex = devindex;
+    DeviceTableCount += 1;
+   };
+
+  // Remember what the table was built for
+  DeviceTableDriverCount = NumDriverDevices;
+  return(1);
+ } 
+
+/*--------------------------------------------------------------------------*/
+
+/* HW_ENUMERATE counts the attached BHPMOD devices using the device table.
+   The count is returned by reference if not NULL.  If DriverIndex is not 
+   NULL, the driver index of the BHPMOD device numbered BhPmodIndex 
+   (counting from 0) is also returned, along with its serial number if 
+   SerialNumber is not NULL, and a 0 is returned if there is no such device.
+   Otherwise a 1/0 pass/fail result is returned.
+*/
+
+DWORD HW_Enumerate(DWORD *NumDevices, DWORD BhPmodIndex, DWORD *DriverIndex, char *SerialNumber)
+ {
+  DWORD result;
+
+  EnterCriticalSection(&DeviceTableLock);
+  result = HW_RefreshTable(0);
+  if(NumDevices != NULL) *NumDevices = DeviceTableCount;
+  if(result && (DriverIndex != NULL))
+   {
+    if(BhPmodIndex < DeviceTableCount)
+     {
+      *DriverIndex = DeviceTable[BhPmodIndex].DriverIndex;
+      if(SerialNumber != NULL) strcpy(SerialNumber, DeviceTable[BhPmodIndex].SerialNumber);
+     }
+    else
+     result = 0;
+   };
+  LeaveCriticalSection(&DeviceTableLock);
+  return(result);
+ } 
+
+/*--------------------------------------------------------------------------*/
+
+/* HW_FINDDEVICE looks up an attached BHPMOD by serial number, or takes the 
+   first one found if the serial number is NULL or empty.  Its driver index
+   is returned by reference, and its serial number too if FoundSerialNumber
+   is not NULL.  A particular device not in the table may have replaced 
+   another since the table was built, so the table is built again once 
+   before giving up.  A 1/0 found/not found result is returned.
+*/
+
+DWORD HW_FindDevice(char *SerialNumber, DWORD *DriverIndex, char *FoundSerialNumber)
+ {
+  DWORD i;
+  BYTE pass, any;
+
+  any = ((SerialNumber == NULL) || (SerialNumber[0] == 0)) ? 1 : 0;
+  EnterCriticalSection(&DeviceTableLock);
+  for(pass=0;pass<(any?1:2);pass++)
+   {
+    if(!HW_RefreshTable(pass)) break;
+    for(i=0;i<DeviceTableCount;i++)
+     if(any || (strcmp(SerialNumber, DeviceTable[i].SerialNumber) == 0))
+      {
+       *DriverIndex = DeviceTable[i].DriverIndex;
+       if(FoundSerialNumber != NULL) strcpy(FoundSerialNumber, DeviceTable[i].SerialNumber);
+       LeaveCriticalSection(&DeviceTableLock);
+       return(1);
+      };
+   };
+  LeaveCriticalSection(&DeviceTableLock);
+  return(0);
+ } 
+
+/*--------------------------------------------------------------------------*/
+
+/* HW_OPEN identifies an attached BHPMOD and opens a handle to it.  If the 
+   serial number is NULL or empty, the first BHPMOD found is opened, 
+   otherwise the one reporting that serial number.  If the device is already
+   open, the same context is returned and must be closed once more.  The 
+   context is returned by reference and a 1/0 pass/fail result by value.
+   If Quiet is set, a device that is not attached is not reported to the 
+   user.
+
+   The driver open, the executor thread and capability discovery, which 
+   waits on the device, are done outside the device list lock, so opening
+   one device does not hold up any other.  The new context is only put in 
+   the list after that, and if another thread has put the same device 
+   there in the meantime, that context is shared and the new one dropped.
+   A device that does not answer discovery is not opened.
+*/
+
+DWORD HW_Open(char *SerialNumber, HW_DEVICE **Device, BYTE Quiet)
+ {
+  DWORD devindex;
+  char serialstr[SI_MAX_DEVICE_STRLEN];
+  HW_DEVICE *device, *shared;
+  HANDLE handle;
+  SI_STATUS status;
+  
+  // MessageBox(NULL, "HW_Open", "", MB_TASKMODAL);
+
+  // Check arguments
+  if(Device == NULL) return(0);
+  *Device = NULL;
+
+  // Set the driver default timeouts
+  // Note that some operations may take a certain amount of time to
+  // respond by design
+  SI_SetTimeouts(HW_RESPONSE_TIMEOUT, HW_RESPONSE_TIMEOUT);
+
+  // Look for the BHPMOD in the device table
+  if(!HW_FindDevice(SerialNumber, &devindex, serialstr))
+   {
+    if(Quiet) return(0);
+    return(ErrorMessage(BHPMOD_ERROR_NOT_FOUND, "BackHauler PMOD was not found", "Device Not Found"));
+   };
+
+  // Share the context if this device is already open
+  EnterCriticalSection(&DeviceListLock);
+  device = HW_ShareDevice(serialstr);
+  LeaveCriticalSection(&DeviceListLock);
+  if(device != NULL)
+   {
+    *Device = device;
+    return(1);
+   };
+
+  // Otherwise open it with a new context
+  // The driver only lets one handle open a device, so a failure may just mean 
+  // that another thread has opened it since the list was checked
+  status = SI_Open(devindex, &handle);
+  if(status != SI_SUCCESS) 
+   {
+    EnterCriticalSection(&DeviceListLock);
+    device = HW_ShareDevice(serialstr);
+    LeaveCriticalSection(&DeviceListLock);
+    if(device != NULL)
+     {
+      *Device = device;
+      return(1);
+     };
+    return(ErrorMessage(BHPMOD_ERROR_DRIVER, "Unable to open driver", "Device Not Found"));
+   };
+  device = (HW_DEVICE *)calloc(1, sizeof(HW_DEVICE));
+  if(device == NULL)
+   {
+    SI_Close(handle);
+    return(ErrorMessage(BHPMOD_ERROR_RESOURCE, "Unable to allocate device memory", "Device Not Found"));
+   };
+  device->Handle = handle;
+  strcpy(device->SerialNumber, serialstr);
+  device->References = 1;
+  device->PipelineWindow = 1;
+  if(!HW_StartExecutor(device))
+   {
+    SI_Close(handle);
+    free(device);
+    return(ErrorMessage(BHPMOD_ERROR_RESOURCE, "Unable to start device thread", "Device Not Found"));
+   };
+
+  // Find out what the firmware can do, and give up on a device that does not answer
+  // The context is not in the list yet, so closing it just stops the thread and frees it
+  if(!HW_Call(device, HW_Discover, NULL))
+   {
+    HW_Close(device);
+    return(ErrorNoResponse());
+   };
+
+  // Put the device in the list, or share the context of another thread that got there first
+  EnterCriticalSection(&DeviceListLock);
+  shared = HW_ShareDevice(serialstr);
+  if(shared == NULL)
+   {
+    device->Next = DeviceList;
+    DeviceList = device;
+   };
+  LeaveCriticalSection(&DeviceListLock);
+  if(shared != NULL)
+   {
+    HW_Close(device);
+    device = shared;
+   };
+  *Device = device;
+  return(1);
+ } 
+
+/*--------------------------------------------------------------------------*/
+
+/* HW_SHAREDEVICE looks for an open device by serial number and adds a 
+   reference to it if found.  The context is returned, or NULL if the 
+   device is not open.  The device list lock must be held.
+*/
+
+HW_DEVICE *HW_ShareDevice(char *SerialNumber)
+ {
+  HW_DEVICE *device;
+
+  for(device=DeviceList;device!=NULL;device=device->Next)
+   if(strcmp(device->SerialNumber, SerialNumber) == 0) break;
+  if(device != NULL) device->References += 1;
+  return(device);
+ } 
+
+/*--------------------------------------------------------------------------*/
+
+/* HW_CLOSE closes the device to which the handle was opened.  The device is
+   actually closed, and its context freed, when every open of it is closed.
+   Anything still in flight is collected first.  No other thread may be 
+   using the handle at the time.
+*/
+
+DWORD HW_Close(HW_DEVICE *Device)
+ {
+  HW_DEVICE **link;
+
+  // MessageBox(NULL, "HW_Close", "", MB_TASKMODAL);
+
+  if(Device == NULL) return(1);
+
+  // Drop a reference, and finish if others remain
+  EnterCriticalSection(&DeviceListLock);
+  Device->References -= 1;
+  if(Device->References > 0)
+   {
+    LeaveCriticalSection(&DeviceListLock);
+    return(1);
+   };
+
+  // Remove the device from the list
+  for(link=&DeviceList;*link!=NULL;link=&(*link)->Next)
+   if(*link == Device) { *link = Device->Next; break; };
+  if(DefaultDevice == Device) DefaultDevice = NULL;
+  LeaveCriticalSection(&DeviceListLock);
+
+  // Stop the executor, which finishes anything in flight, then close and free the device
+  HW_StopExecutor(Device);
+  if(Device->Handle != INVALID_HANDLE_VALUE) SI_Close(Device->Handle);
+  free(Device);
+  return(1);
+ } 
+
+/*--------------------------------------------------------------------------*/
+
+/* HW_DEFAULTDEVICE returns the device used by the functions that do not 
+   take a handle, opening the first device found if none is open yet.  If
+   no device is attached, NULL is returned without troubling the user, and
+   another attempt is made next time.  The device is opened outside the 
+   device list lock, since that waits on the device, and only made the 
+   default if no other thread has set one meanwhile.
+*/
+
+HW_DEVICE *HW_DefaultDevice(void)
+ {
+  HW_DEVICE *device, *opened;
+  BYTE published = 0;
+
+  // Use the default device if there is one
+  EnterCriticalSection(&DeviceListLock);
+  device = DefaultDevice;
+  LeaveCriticalSection(&DeviceListLock);
+  if(device != NULL) return(device);
+
+  // Otherwise open one, and drop the reference to it if another thread set the default first
+  if(!HW_Open(NULL, &opened, 1)) return(NULL);
+  EnterCriticalSection(&DeviceListLock);
+  if(DefaultDevice == NULL)
+   {
+    DefaultDevice = opened;
+    published = 1;
+   };
+  device = DefaultDevice;
+  LeaveCriticalSection(&DeviceListLock);
+  if(!published) HW_Close(opened);
+  return(device);
+ } 
+
+/*--------------------------------------------------------------------------*/
+
+/* HW_RECONNECT opens a device again after the driver has reported an error,
+   as happens when it is unplugged or reset.  Everything in flight fails, 
+   the device is found again by its serial number, and the settings last 
+   sent to it are restored, so the caller can carry on as if nothing had 
+   happened.  If the device is not back yet, it stays marked as broken and
+   the next command tries again.  This runs only on the executor thread.  
+   A 1/0 pass/fail result is returned.
+*/
+
+DWORD HW_Reconnect(HW_DEVICE *Device)
+ {
+  DWORD devindex;
+  HANDLE handle;
+
+  // Drop the old handle and everything in flight with it
+  HW_FailInFlight(Device);
+  HW_CancelReceive(Device);
+  if(Device->Handle != INVALID_HANDLE_VALUE) SI_Close(Device->Handle);
+  Device->Handle = INVALID_HANDLE_VALUE;
+  Device->RxHead = 0;
+  Device->RxCount = 0;
+  Device->Broken = 1;
+
+  // Find the device by serial number and open it again
+  // Driver indexes can be handed out again in a different order, so the table is built afresh
+  EnterCriticalSection(&DeviceTableLock);
+  HW_RefreshTable(1);
+  LeaveCriticalSection(&DeviceTableLock);
+  if(!HW_FindDevice(Device->SerialNumber, &devindex, NULL)) return(ErrorNotReconnected());
+  if(SI_Open(devindex, &handle) != SI_SUCCESS) return(ErrorNotReconnected());
+  Device->Handle = handle;
+
+  // The device may have been given other firmware while it was away
+  // Restore the settings, and try again next time if that fails
+  if(!HW_Discover(Device, NULL) || !HW_Restore(Device)) return(ErrorNotReconnected());
+  Device->Broken = 0;
+  return(1);
+ } 
+
+/*--------------------------------------------------------------------------*/
+
+/* HW_SHADOW keeps a copy of the settings in a command sent to the device
+   so they can be restored after a reconnect.  Commands that change no 
+   settings are ignored.
+*/
+
+void HW_Shadow(HW_DEVICE *Device, BYTE Token, BYTE Count, BYTE *DataMessage)
+ {
+  BYTE bit, pin, pos, size, rsize;
+
+  switch(Token)
+   {
+    case TOKEN_COMMAND_PMOD_SET_CONFIGURATION:
+     if(Count != 1) break;
+     Device->ShadowConfiguration = DataMessage[0];
+     Device->ShadowFlags |= HW_SHADOW_CONFIGURATION;
+     Device->ShadowDriveSet = 0;
+     Device->ShadowStateSet = 0;
+     break;
+
+    case TOKEN_COMMAND_SET_SPI_CLOCK_PHASE:
+     if(Count != 1) break;
+     Device->ShadowClockPhase = DataMessage[0];
+     Device->ShadowFlags |= HW_SHADOW_CLOCK_PHASE;
+     break;
+
+    case TOKEN_COMMAND_SET_SPI_CLOCK_RATE:
+     if(Count != 1) break;
+     Device->ShadowClockDivider = DataMessage[0];
+     Device->ShadowFlags |= HW_SHADOW_CLOCK_RATE;
+     break;
+
+    case TOKEN_COMMAND_SET_SPI_TIMING:
+     if(Count != 2) break;
+     Device->ShadowTiming[0] = DataMessage[0];
+     Device->ShadowTiming[1] = DataMessage[1];
+     Device->ShadowFlags |= HW_SHADOW_TIMING;
+     break;
+
+    case TOKEN_COMMAND_SET_I2C_CLOCK_RATE:
+     if(Count != 2) break;
+     Device->ShadowI2cClock[0] = DataMessage[0];
+     Device->ShadowI2cClock[1] = DataMessage[1];
+     Device->ShadowFlags |= HW_SHADOW_I2C_CLOCK_RATE;
+     break;
+
+    case TOKEN_COMMAND_SET_I2C_TIMEOUT:
+     if(Count != 2) break;
+     Device->ShadowI2cTimeout[0] = DataMessage[0];
+     Device->ShadowI2cTimeout[1] = DataMessage[1];
+     Device->ShadowFlags |= HW_SHADOW_I2C_TIMEOUT;
+     break;
+
+    case TOKEN_COMMAND_SET_SERIAL_LINE:
+     if(Count != 5) break;
+     memcpy(Device->ShadowSerialLine, DataMessage, 5);
+     Device->ShadowFlags |= HW_SHADOW_SERIAL_LINE;
+     break;
+
+    case TOKEN_COMMAND_SET_SERIAL_BUFFERS:
+     if(Count != 4) break;
+     memcpy(Device->ShadowSerialBuffers, DataMessage, 4);
+     Device->ShadowFlags |= HW_SHADOW_SERIAL_BUFFERS;
+     break;
+
+    case TOKEN_COMMAND_SET_SERIAL_EVENTS:
+     if(Count != 3) break;
+     memcpy(Device->ShadowSerialEvents, DataMessage, 3);
+     Device->ShadowFlags |= HW_SHADOW_SERIAL_EVENTS;
+     break;
+
+    case TOKEN_COMMAND_SET_ACQUISITION:
+     // A stop needs no restoring, since a device that reconnects has no job
+     if(Count < 2) break;
+     if((DataMessage[0] == 0) && (DataMessage[1] == 0))
+      {
+       Device->ShadowFlags &= ~HW_SHADOW_ACQUISITION;
+       break;
+      };
+     memcpy(Device->ShadowAcquisition, DataMessage, Count);
+     Device->ShadowAcquisitionCount = Count;
+     Device->ShadowFlags |= HW_SHADOW_ACQUISITION;
+     break;
+
+    case TOKEN_COMMAND_SET_SAMPLE_EVENTS:
+     if(Count != 3) break;
+     memcpy(Device->ShadowSampleEvents, DataMessage, 3);
+     Device->ShadowFlags |= HW_SHADOW_SAMPLE_EVENTS;
+     break;
+
+    case TOKEN_COMMAND_PMOD_SET_PIN_DRIVE:
+     if((Count != 2) || (DataMessage[0] > HW_MAX_SHADOW_PIN)) break;
+     Device->ShadowDrive[DataMessage[0]] = DataMessage[1];
+     Device->ShadowDriveSet |= 1 << DataMessage[0];
+     break;
+
+    case TOKEN_COMMAND_PMOD_WRITE_PIN:
+     if((Count != 2) || (DataMessage[0] > HW_MAX_SHADOW_PIN)) break;
+     Device->ShadowState[DataMessage[0]] = DataMessage[1];
+     Device->ShadowStateSet |= 1 << DataMessage[0];
+     break;
+
+    case TOKEN_COMMAND_PMOD_WRITE_PORT:
+     // Kept pin by pin, the same as if each pin had been written on its own
+     if(Count != 4) break;
+     for(bit = 0; bit < 8; bit++)
+      {
+       pin = PortPins[bit];
+       if(DataMessage[0] & (1 << bit))
+        {
+         Device->ShadowState[pin] = (DataMessage[1] & (1 << bit)) ? 1 : 0;
+         Device->ShadowStateSet |= 1 << pin;
+        };
+       if(DataMessage[2] & (1 << bit))
+        {
+         Device->ShadowDrive[pin] = (DataMessage[3] & (1 << bit)) ? 1 : 0;
+         Device->ShadowDriveSet |= 1 << pin;
+        };
+      };
+     break;
+
+    case TOKEN_COMMAND_OPERATION_LIST:
+     // Pin writes in the list are kept as if each had been sent on its own
+     for(pos = 0; pos < Count; pos += size)
+      {
+       size = ListOperationSize(Count - pos, &DataMessage[pos], &rsize);
+       if(size == 0) break;
+       if(DataMessage[pos] == LIST_OP_WRITE_PIN) HW_Shadow(Device, TOKEN_COMMAND_PMOD_WRITE_PIN, 2, &DataMessage[pos + 1]);
+      };
+     break;
+   };
+ } 
+
+/*--------------------------------------------------------------------------*/
+
+/* HW_RESTORE sends the settings kept by HW_Shadow to the device, in the 
+   order that gives the same end result as when they were first sent.  
+   Nothing may be in flight.  A 1/0 pass/fail result is returned.
+*/
+
+DWORD HW_Restore(HW_DEVICE *Device)
+ {
+  BYTE buf[2];
+  BYTE pin;
+
+  if(Device->ShadowFlags & HW_SHADOW_CONFIGURATION)
+   if(!HW_Exchange(Device, TOKEN_COMMAND_PMOD_SET_CONFIGURATION, 1, &Device->ShadowConfiguration)) return(0);
+  if(Device->ShadowFlags & HW_SHADOW_CLOCK_PHASE)
+   if(!HW_Exchange(Device, TOKEN_COMMAND_SET_SPI_CLOCK_PHASE, 1, &Device->ShadowClockPhase)) return(0);
+  if(Device->ShadowFlags & HW_SHADOW_CLOCK_RATE)
+   if(!HW_Exchange(Device, TOKEN_COMMAND_SET_SPI_CLOCK_RATE, 1, &Device->ShadowClockDivider)) return(0);
+  if(Device->ShadowFlags & HW_SHADOW_TIMING)
+   if(!HW_Exchange(Device, TOKEN_COMMAND_SET_SPI_TIMING, 2, Device->ShadowTiming)) return(0);
+  if(Device->ShadowFlags & HW_SHADOW_I2C_CLOCK_RATE)
+   if(!HW_Exchange(Device, TOKEN_COMMAND_SET_I2C_CLOCK_RATE, 2, Device->ShadowI2cClock)) return(0);
+  if(Device->ShadowFlags & HW_SHADOW_I2C_TIMEOUT)
+   if(!HW_Exchange(Device, TOKEN_COMMAND_SET_I2C_TIMEOUT, 2, Device->ShadowI2cTimeout)) return(0);
+  if(Device->ShadowFlags & HW_SHADOW_SERIAL_LINE)
+   if(!HW_Exchange(Device, TOKEN_COMMAND_SET_SERIAL_LINE, 5, Device->ShadowSerialLine)) return(0);
+  if(Device->ShadowFlags & HW_SHADOW_SERIAL_BUFFERS)
+   if(!HW_Exchange(Device, TOKEN_COMMAND_SET_SERIAL_BUFFERS, 4, Device->ShadowSerialBuffers)) return(0);
+  if(Device->ShadowFlags & HW_SHADOW_SERIAL_EVENTS)
+   if(!HW_Exchange(Device, TOKEN_COMMAND_SET_SERIAL_EVENTS, 3, Device->ShadowSerialEvents)) return(0);
+  // States go before drives, so a pin made push-pull drives its saved level from the start
+  for(pin=0;pin<=HW_MAX_SHADOW_PIN;pin++)
+   if(Device->ShadowStateSet & (1 << pin))
+    {
+     buf[0] = pin;
+     buf[1] = Device->ShadowState[pin];
+     if(!HW_Exchange(Device, TOKEN_COMMAND_PMOD_WRITE_PIN, 2, buf)) return(0);
+    };
+  for(pin=0;pin<=HW_MAX_SHADOW_PIN;pin++)
+   if(Device->ShadowDriveSet & (1 << pin))
+    {
+     buf[0] = pin;
+     buf[1] = Device->ShadowDrive[pin];
+     if(!HW_Exchange(Device, TOKEN_COMMAND_PMOD_SET_PIN_DRIVE, 2, buf)) return(0);
+    };
+  // The job starts again once the pins are set, with its timestamps from 0
+  if(Device->ShadowFlags & HW_SHADOW_ACQUISITION)
+   {
+    if(!HW_Exchange(Device, TOKEN_COMMAND_SET_ACQUISITION, Device->ShadowAcquisitionCount, Device->ShadowAcquisition)) return(0);
+    Device->AcqStamp = 0;
+    Device->AcqTime = 0;
+   };
+  // The device numbers its sample packets from 0 again
+  if(Device->ShadowFlags & HW_SHADOW_SAMPLE_EVENTS)
+   {
+    if(!HW_Exchange(Device, TOKEN_COMMAND_SET_SAMPLE_EVENTS, 3, Device->ShadowSampleEvents)) return(0);
+    Device->SampleSequence = 0;
+   };
+  return(1);
+ } 
+
+/*--------------------------------------------------------------------------*/
+
+/* HW_EXCHANGE sends a command that has a status response and waits for the
+   response, outside of the pipeline window.  Nothing may be in flight.  A 
+   1/0 pass/fail result is returned, and a status with the error bit set, 
+   as for a setting the device will not take, is a failure.
+*/
+
+DWORD HW_Exchange(HW_DEVICE *Device, BYTE Token, BYTE Count, void *DataMessage)
+ {
+  BYTE token, cnt, status;
+
+  if(!HW_SendDeviceCommand(Device, Token, Count, DataMessage, 0, 0)) return(0);
+  cnt = 1;
+  if(!HW_GetDeviceResponse(Device, &token, &cnt, &status)) return(0);
+  if((token != TOKEN_RESPONSE_STATUS) || (cnt < 1)) return(0);
+  return((status & STATUS_BIT_ERROR) ? 0 : 1);
+ } 
+
+/*--------------------------------------------------------------------------*/
+
+/* HW_EXCHANGEREQUEST sends a command and completes the request given from 
+   its response, outside of the pipeline window, as the executor functions 
+   do when they need a command of the baseline protocol.  Nothing may be in 
+   flight.  A 1/0 pass/fail result is returned.
+*/
+
+DWORD HW_ExchangeRequest(HW_DEVICE *Device, BYTE Token, BYTE Count, void *DataMessage, HW_REQUEST *Request)
+ {
+  BYTE data[62];
+  BYTE token, cnt;
+
+  if(!HW_SendDeviceCommand(Device, Token, Count, DataMessage, 0, 0)) return(FailRequest(Request));
+  cnt = 62;
+  if(!HW_GetDeviceResponse(Device, &token, &cnt, data))
+   {
+    FailRequest(Request);
+    return(ErrorNoResponse());
+   };
+  if(cnt > 62) cnt = 62;
+  return(CompleteRequest(Request, token, cnt, data));
+ } 
+
+
+/*--------------------------------------------------------------------------*/
+
+/* HW_SENDDEVICECOMMAND sends the specified command and data to the device 
+   over the USB driver infrastructure.  If Sequenced is set, the command
+   carries the sequence number given, which leaves room for only 61 data
+   bytes.  A 1/0 pass/fail response is returned.
+*/
+
+DWORD HW_SendDeviceCommand(HW_DEVICE *Device, BYTE Token, BYTE Count, void *DataMessage, BYTE Sequenced, BYTE Sequence)
+ {
+  SI_STATUS status;
+  BYTE packet[64];
+  BYTE header;
+  DWORD WrCnt;
+
+  // MessageBox(NULL, "HW_SendDeviceCommand", "", MB_TASKMODAL);
+
+  // Check device
+  if(Device == NULL) return(0);
+  if(Device->Handle == INVALID_HANDLE_VALUE) return(0);  
+
+  // Check arguments
+  header = Sequenced ? 3 : 2;
+  if(Count > 64 - header) return(0);
+  if((Count > 0) && (DataMessage == NULL)) return(0);
+
+  // Construct packet
+  packet[0] = Token;
+  packet[1] = Count;
+  if(Sequenced)
+   {
+    packet[1] |= COUNT_BIT_SEQUENCE;
+    packet[2] = Sequence;
+   };
+  if(Count > 0) memcpy(&packet[header], DataMessage, Count);
+
+  // Send packet
+  // A driver error means the device has gone, so it is reconnected before its next use
+  status = SI_Write(Device->Handle, packet, Count+header, &WrCnt); 
+  if(status != SI_SUCCESS) 
+   {
+    Device->Broken = 1;
+    return(ErrorInternal());
+   };
+
+  // Return success
+  return(1);
+ } 
+
+/*--------------------------------------------------------------------------*/
+
+/* HW_GETDEVICERESPONSE attempts to receive an ordinary command response.  
+   The token and count will be read, followed by the message contents.  
+   If the read was successful within the default timeout, then a 1 is 
+   returned, otherwise a zero is returned.  The data are returned by 
+   reference.  Up to 62 bytes can be returned in the data message; but 
+   for convenience in passing variables of arbitrary type, the routine
+   will not return more data than the count in the argument on entry.
+   However, the count will be updated on exit to reflect the number of 
+   bytes actually provided in the response packet.  This can help the
+   caller interpret an unexpected response.  Less data can be returned
+   than in the count on entry.  The full response is always cleared from 
+   the receive ring by this routine.
+
+   Responses are parsed from the receive ring rather than read from the 
+   driver piecemeal.  A single driver read usually brings in the whole 
+   response, and when commands are pipelined it brings in several, so 
+   the later responses are collected without calling the driver at all.
+   A response with a count that cannot be valid means the stream is out
+   of step, so the ring is flushed and a 0 returned.  A sequence number 
+   in the response is skipped here, and looked at by the caller if needed.
+   Serial bytes the device pushed ahead of the response are passed on.
+*/ 
+
+DWORD HW_GetDeviceResponse(HW_DEVICE *Device, BYTE *Token, BYTE *Count, void *DataMessage)
+ {
+  BYTE limit_count = *Count;
+  BYTE *data = (BYTE *)DataMessage;
+  DWORD header, i;
+
+  // MessageBox(NULL, "HW_GetDeviceResponse", "", MB_TASKMODAL);
+
+  // Check device
+  if(Device == NULL) return(0);
+  if(Device->Handle == INVALID_HANDLE_VALUE) return(0);  
+
+  // Check arguments
+  if(Token == NULL) return(0);
+  if(Count == NULL) return(0);
+  if((*Count > 0) && (DataMessage == NULL)) return(0);
+
+  // Make sure the token and count are held, then check the count
+  // Serial bytes or samples pushed by the device can come between any two responses
+  do
+   if(!HW_FillReceive(Device, 2)) return(0);
+  while(HW_TakeEvent(Device, 1));
+  if(RX_COUNT(Device) > 62)
+   {
+    HW_FlushReceive(Device);
+    return(0);
+   };
+
+  // Make sure the whole response is held
+  header = RX_HEADER(Device);
+  if(!HW_FillReceive(Device, header + RX_COUNT(Device))) return(0);
+
+  // Copy out the response and remove it from the ring
+  *Token = RX_PEEK(Device, 0);
+  *Count = RX_COUNT(Device);
+  if(*Count < limit_count) limit_count = *Count;
+  for(i = 0; i < limit_count; i++) data[i] = RX_PEEK(Device, header + i);
+  Device->RxHead = (Device->RxHead + header + *Count) & HW_RX_RING_MASK;
+  Device->RxCount -= header + *Count;
+
+  // Return success
+  return(1);
+ } 
+
+/*--------------------------------------------------------------------------*/
+
+/* HW_FILLRECEIVE makes sure at least the needed number of bytes are held
+   in the receive ring, reading from the driver only if they are not.  
+   The driver returns whatever it has available up to the size asked for,
+   so each read asks for all the free space to the end of the ring and 
+   takes in as many packets as have arrived.  Bytes that arrive before a 
+   timeout are kept for the next call.  A 1/0 pass/fail result is returned.
+
+   Reads are overlapped so that the executor can also wait for new jobs 
+   while a read is pending.  A read left pending by a timeout stays pending
+   and is picked up by the next call rather than issued again.
+*/
+
+DWORD HW_FillReceive(HW_DEVICE *Device, DWORD Needed)
+ {
+  // Read until enough is held
+  while(Device->RxCount < Needed)
+   {
+    if(!HW_StartReceive(Device)) return(0);
+    if(WaitForSingleObject(Device->RxOverlapped.hEvent, HW_RESPONSE_TIMEOUT) != WAIT_OBJECT_0) return(0);
+    if(!HW_FinishReceive(Device)) return(0);
+   };
+
+  // Return success
+  return(1);
+ } 
+
+/*--------------------------------------------------------------------------*/
+
+/* HW_STARTRECEIVE makes sure an overlapped read into the free space up to
+   the end of the ring is pending.  The read event is set when it finishes, 
+   which can be straight away.  A 1/0 pass/fail result is returned.
+*/
+
+DWORD HW_StartReceive(HW_DEVICE *Device)
+ {
+  SI_STATUS status;
+  DWORD tail, space;
+
+  // Only one read at a time
+  if(Device->RxPending) return(1);
+  if(Device->Handle == INVALID_HANDLE_VALUE) return(0);  
+
+  // Read into the free space up to the end of the ring
+  tail = (Device->RxHead + Device->RxCount) & HW_RX_RING_MASK;
+  space = HW_RX_RING_SIZE - Device->RxCount;
+  if(space > HW_RX_RING_SIZE - tail) space = HW_RX_RING_SIZE - tail;
+  if(space > SI_MAX_READ_SIZE) space = SI_MAX_READ_SIZE;
+  if(space == 0) return(0);
+  Device->RxRead = 0;
+  ResetEvent(Device->RxOverlapped.hEvent);
+  status = SI_Read(Device->Handle, &Device->RxRing[tail], space, &Device->RxRead, &Device->RxOverlapped);
+  if((status != SI_SUCCESS) && (status != SI_IO_PENDING)) 
+   {
+    Device->Broken = 1;
+    return(0);
+   };
+  Device->RxPending = 1;
+
+  // A read that finished straight away is taken when the event is seen
+  if(status == SI_SUCCESS) SetEvent(Device->RxOverlapped.hEvent);
+  return(1);
+ } 
+
+/*--------------------------------------------------------------------------*/
+
+/* HW_FINISHRECEIVE takes the bytes of a read that has finished into the 
+   receive ring.  A 1/0 pass/fail result is returned, where a read that 
+   brought nothing in is a failure.
+*/
+
+DWORD HW_FinishReceive(HW_DEVICE *Device)
+ {
+  DWORD RdCnt = Device->RxRead;
+  DWORD tail, space;
+
+  // Get the result of the read
+  if(!Device->RxPending) return(0);
+  Device->RxPending = 0;
+  if(!GetOverlappedResult(Device->Handle, &Device->RxOverlapped, &RdCnt, FALSE)) 
+   {
+    Device->Broken = 1;
+    return(0);
+   };
+  
+  // Add the bytes read to the ring
+  tail = (Device->RxHead + Device->RxCount) & HW_RX_RING_MASK;
+  space = HW_RX_RING_SIZE - Device->RxCount;
+  if(space > HW_RX_RING_SIZE - tail) space = HW_RX_RING_SIZE - tail;
+  if(RdCnt > space) return(0);
+  Device->RxCount += RdCnt;
+  if(RdCnt == 0) return(0);
+  Device->RxActivity = GetTickCount();
+  return(1);
+ } 
+
+/*--------------------------------------------------------------------------*/
+
+/* HW_CANCELRECEIVE cancels a pending read and waits for it to be done with
+   the ring.  Anything it brought in is discarded.
+*/
+
+void HW_CancelReceive(HW_DEVICE *Device)
+ {
+  DWORD RdCnt;
+
+  if(!Device->RxPending) return;
+  SI_CancelIoEx(Device->Handle, &Device->RxOverlapped);
+  GetOverlappedResult(Device->Handle, &Device->RxOverlapped, &RdCnt, TRUE);
+  Device->RxPending = 0;
+ } 
+
+/*--------------------------------------------------------------------------*/
+
+/* HW_RESPONSEHELD returns a 1 if the next response is held whole in the
+   receive ring, so that collecting it will not wait on the driver.  A 
+   count that cannot be valid also counts, since it fails without waiting.
+   Responses held that are older than the oldest command in flight are 
+   discarded first, so that collecting does not wait on the driver for 
+   the one after them.  Events pushed ahead of it are passed on.
+*/
+
+DWORD HW_ResponseHeld(HW_DEVICE *Device)
+ {
+  DWORD size;
+
+  while(1)
+   {
+    if(Device->RxCount < 2) return(0);
+    if(HW_TakeEvent(Device, 0)) continue;
+    if(RX_COUNT(Device) > 62) return(1);
+    size = RX_HEADER(Device) + RX_COUNT(Device);
+    if(Device->RxCount < size) return(0);
+    if((Device->PipelineCount == 0) || (HW_ResponseAge(Device, &Device->PipelineRequest[Device->PipelineHead]) >= 0)) return(1);
+    Device->RxHead = (Device->RxHead + size) & HW_RX_RING_MASK;
+    Device->RxCount -= size;
+   };
+ } 
+
+/*--------------------------------------------------------------------------*/
+
+/* HW_RESPONSEAGE compares the sequence number of the next response, whose
+   header must be held, with that of a request.  The result is 0 if the 
+   response is for the request or has no sequence number, negative if it 
+   is for an earlier command and positive if for a later one.  A response 
+   with a sequence number can only be for an earlier command if the 
+   request has none, because the device answers in order.
+*/
+
+int HW_ResponseAge(HW_DEVICE *Device, HW_REQUEST *Request)
+ {
+  if(!(RX_PEEK(Device, 1) & COUNT_BIT_SEQUENCE)) return(0);
+  if(!Request->Sequenced) return(-1);
+  return((signed char)(RX_PEEK(Device, 2) - Request->Sequence));
+ } 
+
+/*--------------------------------------------------------------------------*/
+
+/* HW_FLUSHRECEIVE discards everything received but not yet collected,
+   both in the receive ring and in the driver buffers.
+*/
+
+void HW_FlushReceive(HW_DEVICE *Device)
+ {
+  HW_CancelReceive(Device);
+  Device->RxHead = 0;
+  Device->RxCount = 0;
+  if(Device->Handle != INVALID_HANDLE_VALUE) SI_FlushBuffers(Device->Handle, 1, 1);
+ } 
+
+/*--------------------------------------------------------------------------*/
+
+/* HW_TAKEEVENT takes a packet that the device pushed without being asked
+   from the head of the receive ring, if that is what is there, and passes 
+   on the serial bytes or samples it carries.  If Wait is set, the driver 
+   is read for the rest of the packet if needed, otherwise the packet is 
+   only taken once it is held whole.  The token and count must be held.  
+   A 1 is returned if a packet was taken.
+*/
+
+DWORD HW_TakeEvent(HW_DEVICE *Device, BYTE Wait)
+ {
+  BYTE data[62];
+  BYTE token;
+  DWORD count, i;
+
+  // Check that a whole event is there
+  token = RX_PEEK(Device, 0);
+  if((token != TOKEN_EVENT_SERIAL_RX) && (token != TOKEN_EVENT_SAMPLES)) return(0);
+  count = RX_PEEK(Device, 1);
+  if(count > 62) return(0);
+  if(Wait && !HW_FillReceive(Device, 2 + count)) return(0);
+  if(Device->RxCount < 2 + count) return(0);
+
+  // Take the data out of the receive ring
+  for(i = 0; i < count; i++) data[i] = RX_PEEK(Device, 2 + i);
+  Device->RxHead = (Device->RxHead + 2 + count) & HW_RX_RING_MASK;
+  Device->RxCount -= 2 + count;
+
+  if(token == TOKEN_EVENT_SERIAL_RX)
+   HW_KeepSerial(Device, count, data);
+  else
+   HW_KeepSamples(Device, count, data);
+  return(1);
+ } 
+
+/*--------------------------------------------------------------------------*/
+
+/* HW_KEEPSERIAL hands serial bytes that the device pushed to the serial 
+   callback or keeps them for BHPMOD_SERIAL_WaitRead.  Callbacks are made 
+   on the executor thread, so a callback must not wait on a function for 
+   the same device.
+*/
+
+void HW_KeepSerial(HW_DEVICE *Device, DWORD Count, BYTE *Content)
+ {
+  DWORD tail, i;
+
+  // Hand them to the callback, or keep them and wake any reader
+  if(Device->SerialCallback != NULL)
+   {
+    Device->SerialCallback(Device, Count, Content, Device->SerialContext);
+    return;
+   };
+  EnterCriticalSection(&Device->SerialLock);
+  for(i = 0; i < Count; i++)
+   {
+    if(Device->SerialCount == HW_SERIAL_RING_SIZE)
+     {
+      Device->SerialHead = (Device->SerialHead + 1) % HW_SERIAL_RING_SIZE;
+      Device->SerialCount -= 1;
+     };
+    tail = (Device->SerialHead + Device->SerialCount) % HW_SERIAL_RING_SIZE;
+    Device->SerialRing[tail] = Content[i];
+    Device->SerialCount += 1;
+   };
+  LeaveCriticalSection(&Device->SerialLock);
+  if(Count > 0) SetEvent(Device->SerialArrived);
+ } 
+
+/*--------------------------------------------------------------------------*/
+
+/* HW_KEEPSAMPLES puts the samples in a packet that the device pushed into 
+   the sample ring for BHPMOD_STREAM_Peek.  Each record is written before 
+   the tail is moved past it, so the reader never sees a record half 
+   written.  Samples that do not fit are dropped and counted, as are the 
+   samples the device reports it dropped and packets missed in the 
+   sequence.  The timestamps are carried on as for BHPMOD_ACQ_Read.
+*/
+
+void HW_KeepSamples(HW_DEVICE *Device, DWORD Count, BYTE *Content)
+ {
+  BHPMOD_SAMPLE *sample;
+  BYTE *record;
+  DWORD n, size, i;
+  LONG tail;
+  WORD stamp;
+
+  // Check the packet and count what was missed
+  if(Count < 4) return;
+  n = Content[1];
+  size = Content[2];
+  if((size > BHPMOD_MAX_SAMPLE_SIZE) || (Count != 4 + (n * (2 + size)))) return;
+  if(Content[0] != Device->SampleSequence) InterlockedExchangeAdd(&Device->SamplesMissed, (BYTE)(Content[0] - Device->SampleSequence));
+  Device->SampleSequence = Content[0] + 1;
+  InterlockedExchangeAdd(&Device->SamplesLost, Content[3]);
+
+  // Keep each sample that fits, then publish them together
+  tail = Device->SampleTail;
+  for(i = 0; i < n; i++)
+   {
+    record = &Content[4 + (i * (2 + size))];
+    stamp = MAKEWORD(record[1], record[0]);
+    Device->AcqTime += (WORD)(stamp - Device->AcqStamp);
+    Device->AcqStamp = stamp;
+    if((Device->SampleRing == NULL) || ((DWORD)(tail - Device->SampleHead) > Device->SampleMask))
+     {
+      InterlockedIncrement(&Device->SamplesDropped);
+      continue;
+     };
+    sample = &Device->SampleRing[tail & Device->SampleMask];
+    sample->Timestamp = Device->AcqTime;
+    sample->Size = (BYTE)size;
+    memcpy(sample->Content, &record[2], size);
+    tail += 1;
+   };
+  if(tail != Device->SampleTail)
+   {
+    InterlockedExchange(&Device->SampleTail, tail);
+    SetEvent(Device->SampleArrived);
+   };
+ } 
+
+/*--------------------------------------------------------------------------*/
+
+/* HW_POSTCOMMAND sends a command to the device and records the request at 
+   the end of the pipeline window so that its response can be collected 
+   later.  If the window is already full, the oldest response is collected
+   first to make room.  A failure there belongs to an earlier command, so 
+   it is only counted.  A 1/0 pass/fail response is returned for the send.
+   If the send fails, the request is finished here with that failure.
+   This runs only on the executor thread.
+*/
+
+DWORD HW_PostCommand(HW_DEVICE *Device, BYTE Token, BYTE Count, void *DataMessage, HW_REQUEST *Request)
+ {
+  // Errors found from here on belong to this command
+  HW_ClearError();
+
+  // Reconnect first if the device was lost
+  if(Device->Broken && !HW_Reconnect(Device))
+   {
+    FailRequest(Request);
+    return(HW_FinishRequest(Device, Request, 0, 0));
+   };
+
+  // Make room in the window
+  while(Device->PipelineCount >= Device->PipelineWindow)
+   HW_CollectResponse(Device, 0);
+
+  // Number the command if there is room for it
+  Request->Sequenced = (Device->Sequencing && (Count <= 61)) ? 1 : 0;
+  if(Request->Sequenced) Request->Sequence = Device->SequenceNext++;
+
+  // Send the command, reconnecting once if the device has just been lost
+  if(!HW_SendDeviceCommand(Device, Token, Count, DataMessage, Request->Sequenced, Request->Sequence) &&
+     !(Device->Broken && HW_Reconnect(Device) && 
+       HW_SendDeviceCommand(Device, Token, Count, DataMessage, Request->Sequenced, Request->Sequence)))
+   {
+    FailRequest(Request);
+    return(HW_FinishRequest(Device, Request, 0, 0));
+   };
+  HW_Shadow(Device, Token, Count, (BYTE *)DataMessage);
+
+  // Record what is expected in response 
+  // The response timeout runs from now if nothing else was in flight
+  if(Device->PipelineCount == 0) Device->RxActivity = GetTickCount();
+  Device->PipelineRequest[(Device->PipelineHead + Device->PipelineCount) % HW_MAX_PIPELINE_WINDOW] = *Request;
+  Device->PipelineCount += 1;
+  if(HW_AWAITED(Request)) Device->PipelineWaiting += 1;
+
+  // Return success
+  return(1);
+ } 
+
+/*--------------------------------------------------------------------------*/
+
+/* HW_COLLECTRESPONSE collects the response to the oldest command in the 
+   pipeline window and completes its request.  If no response arrives, the
+   responses in the pipe can no longer be matched to their commands, so the
+   driver buffers are flushed and every command in flight fails.  Responses
+   with sequence numbers for earlier commands are discarded on the way,
+   and a response to a later command means the one sought was lost, so its
+   request fails and the response is left for its own.  The 1/0 
+   result of the oldest request is returned, and a 0 if nothing was in flight.
+   If Report is 0 and nobody is waiting on the request, a failure is counted 
+   for the pipeline, otherwise the caller is expected to report it.
+   This runs only on the executor thread.
+*/
+
+DWORD HW_CollectResponse(HW_DEVICE *Device, BYTE Report)
+ {
+  HW_REQUEST request;
+  BYTE token, cnt;
+  BYTE buf[64];
+  int age;
+
+  // Check there is something to collect
+  if(Device == NULL) return(0);
+  if(Device->PipelineCount == 0) return(0);
+
+  // Take the oldest request from the window
+  request = Device->PipelineRequest[Device->PipelineHead];
+  Device->PipelineHead = (Device->PipelineHead + 1) % HW_MAX_PIPELINE_WINDOW;
+  Device->PipelineCount -= 1;
+  if(HW_AWAITED(&request)) Device->PipelineWaiting -= 1;
+
+  // Find the response, discarding any left over from earlier commands
+  // Errors found from here on belong to this request
+  HW_ClearError();
+  while(1)
+   {
+    if(!HW_FillReceive(Device, 2) || !HW_FillReceive(Device, RX_HEADER(Device))) 
+     return(HW_LoseResponses(Device, &request, Report));
+    if(HW_TakeEvent(Device, 1)) continue;
+    age = HW_ResponseAge(Device, &request);
+    if(age == 0) break;
+    if(age > 0)
+     {
+      ErrorNoResponse();
+      FailRequest(&request);
+      return(HW_FinishRequest(Device, &request, 0, Report));
+     };
+    cnt = 0;
+    if(!HW_GetDeviceResponse(Device, &token, &cnt, NULL)) return(HW_LoseResponses(Device, &request, Report));
+   };
+
+  // Get the response and complete the request
+  cnt = 62;
+  if(HW_GetDeviceResponse(Device, &token, &cnt, buf)) 
+   return(HW_FinishRequest(Device, &request, CompleteRequest(&request, token, cnt, buf), Report));
+
+  // Recover from a lost response
+  return(HW_LoseResponses(Device, &request, Report));
+ } 
+
+/*--------------------------------------------------------------------------*/
+
+/* HW_LOSERESPONSES recovers from the loss of the response to a request 
+   already taken from the pipeline window.  The driver buffers are flushed 
+   and that request and every other command in flight fail with the error
+   recorded for the loss.  A 0 is returned.  Report applies to the given 
+   request as for HW_CollectResponse.  Responses with sequence numbers that
+   come after all are discarded as they arrive, so the buffers are left as
+   they are if every command in flight had one, unless the device was lost.
+*/
+
+DWORD HW_LoseResponses(HW_DEVICE *Device, HW_REQUEST *Request, BYTE Report)
+ {
+  BYTE flush = (!Request->Sequenced || Device->Broken) ? 1 : 0;
+  BYTE i;
+
+  // Record why before failing the requests, so that each takes the error
+  if(Device->Broken) ErrorInternal();
+  else ErrorNoResponse();
+  for(i = 0; i < Device->PipelineCount; i++)
+   if(!Device->PipelineRequest[(Device->PipelineHead + i) % HW_MAX_PIPELINE_WINDOW].Sequenced) flush = 1;
+  if(flush) HW_FlushReceive(Device);
+  FailRequest(Request);
+  HW_FinishRequest(Device, Request, 0, Report);
+  HW_FailInFlight(Device);
+  return(0);
+ } 
+
+/*--------------------------------------------------------------------------*/
+
+/* HW_FAILINFLIGHT fails every command in flight, oldest first, without 
+   waiting for any response.  Failures are counted for the pipeline.
+*/
+
+void HW_FailInFlight(HW_DEVICE *Device)
+ {
+  HW_REQUEST request;
+
+  while(Device->PipelineCount > 0)
+   {
+    request = Device->PipelineRequest[Device->PipelineHead];
+    Device->PipelineHead = (Device->PipelineHead + 1) % HW_MAX_PIPELINE_WINDOW;
+    Device->PipelineCount -= 1;
+    if(HW_AWAITED(&request)) Device->PipelineWaiting -= 1;
+    FailRequest(&request);
+    HW_FinishRequest(Device, &request, 0, 0);
+   };
+ } 
+
+/*--------------------------------------------------------------------------*/
+
+/* HW_COLLECTALL collects every response still in flight.  A 1 is returned 
+   if all succeeded, otherwise a 0.  Failures are counted for the pipeline.
+   This runs only on the executor thread.
+*/
+
+DWORD HW_CollectAll(HW_DEVICE *Device)
+ {
+  DWORD result = 1;
+
+  if(Device == NULL) return(0);
+  while(Device->PipelineCount > 0)
+   if(!HW_CollectResponse(Device, 0)) result = 0;
+  return(result);
+ } 
+
+/*--------------------------------------------------------------------------*/
+
+/* HW_FINISHREQUEST hands the result of a request to whoever is waiting on 
+   it.  A job with a callback is called back and then freed, and a callback
+   for a failure can find the error by BHPMOD_GetLastError since it is made
+   on the thread that recorded it.  A waiting job is given a copy of the 
+   error instead.  If nobody is waiting, a failure is counted for the 
+   pipeline unless Report is set.  A failure always has an error recorded 
+   for it.  A posted write failure is held instead, and a synchronous call
+   finishing later fails with it.  The result is returned for convenience.
+*/
+
+DWORD HW_FinishRequest(HW_DEVICE *Device, HW_REQUEST *Request, DWORD Result, BYTE Report)
+ {
+  HW_JOB *job = Request->Job;
+  HW_ERROR *error = HW_ThreadError();
+
+  // Make sure a failure has an error recorded for it
+  if(!Result && (error != NULL) && (error->Code == BHPMOD_ERROR_NONE)) ErrorBadResponse();
+
+  // Hold the first posted write failure for the next synchronous call
+  if(Request->Posted)
+   {
+    if(!Result && !Device->PostedFailed)
+     {
+      HW_TakeError(&Device->PostedError);
+      Device->PostedFailed = 1;
+     };
+    return(Result);
+   };
+
+  if((job != NULL) && (job->Callback != NULL))
+   {
+    job->Callback(Device, Result, job->CallbackContext);
+    _aligned_free(job);
+   }
+  else if(job != NULL)
+   {
+    if(Device->PostedFailed) Result = HW_ReportPosted(Device);
+    job->Result = Result;
+    if(!Result) HW_TakeError(&job->Error);
+    SetEvent(job->Done);
+   }
+  else if(!Result && !Report) 
+   Device->PipelineFailures += 1;
+  return(Result);
+ } 
+
+/*--------------------------------------------------------------------------*/
+/* Executor Functions                                                       */
+/*--------------------------------------------------------------------------*/
+
+/* All traffic with a device is done by one executor thread per device. 
+   Application threads hand it jobs through a lock-free queue and wait on an
+   event of their own for the result, so any number of threads can use a 
+   device at once without their packets being mixed up on the pipe.  The 
+   executor takes everything queued at once and posts the commands into the 
+   pipeline window before collecting responses, so commands from several 
+   threads share the USB round trip when the window allows it.
+
+   While responses are awaited, the executor waits on an overlapped read 
+   and on new jobs at the same time.  Jobs queued meanwhile are posted as 
+   soon as they arrive and responses are completed as they come in, so 
+   asynchronous commands from many callers keep the window full without 
+   any caller or extra thread blocking on the device.
+*/
+
+/* HW_STARTEXECUTOR creates the queue, the read event and what holds serial
+   bytes and samples pushed by the device, and starts the executor thread 
+   of a newly opened device.  The thread takes a reference to the DLL
+   which it releases as it exits.  A 1/0 pass/fail result is returned.
+*/
+
+DWORD HW_StartExecutor(HW_DEVICE *Device)
+ {
+  InitializeSListHead(&Device->Queue);
+  Device->Stopping = 0;
+  Device->Wakeup = CreateEvent(NULL, FALSE, FALSE, NULL);
+  if(Device->Wakeup == NULL) return(0);
+  Device->RxOverlapped.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+  if(Device->RxOverlapped.hEvent == NULL)
+   {
+    CloseHandle(Device->Wakeup);
+    return(0);
+   };
+  Device->SerialArrived = CreateEvent(NULL, FALSE, FALSE, NULL);
+  if(Device->SerialArrived == NULL)
+   {
+    CloseHandle(Device->RxOverlapped.hEvent);
+    CloseHandle(Device->Wakeup);
+    return(0);
+   };
+  Device->SampleArrived = CreateEvent(NULL, FALSE, FALSE, NULL);
+  if(Device->SampleArrived == NULL)
+   {
+    CloseHandle(Device->SerialArrived);
+    CloseHandle(Device->RxOverlapped.hEvent);
+    CloseHandle(Device->Wakeup);
+    return(0);
+   };
+  if(!GetModuleHandleEx(GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS, (LPCTSTR)HW_Executor, &Device->Module))
+   {
+    CloseHandle(Device->SampleArrived);
+    CloseHandle(Device->SerialArrived);
+    CloseHandle(Device->RxOverlapped.hEvent);
+    CloseHandle(Device->Wakeup);
+    return(0);
+   };
+  InitializeCriticalSection(&Device->SerialLock);
+  Device->Executor = CreateThread(NULL, 0, HW_Executor, Device, 0, NULL);
+  if(Device->Executor == NULL)
+   {
+    DeleteCriticalSection(&Device->SerialLock);
+    FreeLibrary(Device->Module);
+    CloseHandle(Device->SampleArrived);
+    CloseHandle(Device->SerialArrived);
+    CloseHandle(Device->RxOverlapped.hEvent);
+    CloseHandle(Device->Wakeup);
+    return(0);
+   };
+  return(1);
+ } 
+
+/*--------------------------------------------------------------------------*/
+
+/* HW_STOPEXECUTOR asks the executor thread of a device to finish and waits 
+   for it.  If the process is exiting, the thread is already gone, so there
+   is nothing to wait for.  Any read still pending is cancelled.
+*/
+
+void HW_StopExecutor(HW_DEVICE *Device)
+ {
+  InterlockedExchange(&Device->Stopping, 1);
+  if(!ProcessDetaching)
+   {
+    SetEvent(Device->Wakeup);
+    WaitForSingleObject(Device->Executor, INFINITE);
+   };
+  HW_CancelReceive(Device);
+  CloseHandle(Device->Executor);
+  CloseHandle(Device->Wakeup);
+  CloseHandle(Device->RxOverlapped.hEvent);
+  CloseHandle(Device->SerialArrived);
+  CloseHandle(Device->SampleArrived);
+  DeleteCriticalSection(&Device->SerialLock);
+  free(Device->SampleRing);
+ } 
+
+/*--------------------------------------------------------------------------*/
+
+/* HW_EXECUTOR is the executor thread for a device.  It sleeps until jobs
+   are queued, a response arrives for someone waiting on it, or pin writes
+   held for combining fall due.  While the device pushes serial bytes or 
+   samples it also keeps a read pending for them, so it is the thread that
+   reads them from the driver, and passes them on as they arrive, 
+   collecting any responses held ahead of them first.  Jobs are
+   run in the order they were queued, and responses are completed as soon
+   as they are held whole.  If the oldest awaited response does not start 
+   to arrive in time, every command in flight fails.  When asked to stop, 
+   it finishes what has been queued and collects everything in flight 
+   before exiting.  The thread holds a reference to the DLL so that the 
+   DLL cannot be unloaded while the thread runs.
+*/
+
+DWORD WINAPI HW_Executor(LPVOID Parameter)
+ {
+  HW_DEVICE *Device = (HW_DEVICE *)Parameter;
+  PSLIST_ENTRY entry, next, fifo;
+  HANDLE events[2];
+  HW_REQUEST request;
+  DWORD wait, elapsed, timeout, combine;
+  BYTE receiving;
+  HMODULE module;
+
+  events[0] = Device->Wakeup;
+  events[1] = Device->RxOverlapped.hEvent;
+  while(1)
+   {
+    // Wait for jobs, for the device while anyone waits on a response or 
+    // serial bytes or samples are pushed, and for held pin writes to fall due
+    combine = HW_CombineWait(Device);
+    receiving = (((Device->PipelineWaiting > 0) || Device->SerialEvents || Device->SampleEvents) && HW_StartReceive(Device)) ? 1 : 0;
+    if(receiving)
+     {
+      timeout = INFINITE;
+      if(Device->PipelineWaiting > 0)
+       {
+        elapsed = GetTickCount() - Device->RxActivity;
+        timeout = (elapsed < HW_RESPONSE_TIMEOUT) ? HW_RESPONSE_TIMEOUT - elapsed : 0;
+       };
+      wait = WaitForMultipleObjects(2, events, FALSE, (combine < timeout) ? combine : timeout);
+     }
+    else
+     wait = WaitForSingleObject(Device->Wakeup, (Device->PipelineWaiting > 0) ? 0 : combine);
+
+    // Take in what was read, or recover if the oldest awaited response is overdue
+    if(wait == WAIT_OBJECT_0 + 1) 
+     HW_FinishReceive(Device);
+    else if((wait == WAIT_TIMEOUT) && (Device->PipelineWaiting > 0) && !HW_ResponseHeld(Device) &&
+            (!receiving || (GetTickCount() - Device->RxActivity >= HW_RESPONSE_TIMEOUT)))
+     {
+      request = Device->PipelineRequest[Device->PipelineHead];
+      Device->PipelineHead = (Device->PipelineHead + 1) % HW_MAX_PIPELINE_WINDOW;
+      Device->PipelineCount -= 1;
+      if(HW_AWAITED(&request)) Device->PipelineWaiting -= 1;
+      HW_LoseResponses(Device, &request, 0);
+     };
+
+    // Take everything queued and put it back into the order it was queued
+    entry = InterlockedFlushSList(&Device->Queue);
+    fifo = NULL;
+    while(entry != NULL)
+     {
+      next = entry->Next;
+      entry->Next = fifo;
+      fifo = entry;
+      entry = next;
+     };
+
+    // Run the jobs
+    // The next job is found first because a finished job can disappear
+    while(fifo != NULL)
+     {
+      next = fifo->Next;
+      HW_RunJob(Device, (HW_JOB *)fifo);
+      fifo = next;
+     };
+
+    // Send held pin writes that have fallen due
+    if(HW_CombineWait(Device) == 0) HW_FlushCombined(Device);
+
+    // Complete the responses held for those waiting on them, then pass on serial bytes and samples
+    // While events are pushed, responses nobody waits on are collected too so they do not hold the events up
+    while(((Device->PipelineWaiting > 0) || ((Device->SerialEvents || Device->SampleEvents) && (Device->PipelineCount > 0))) && 
+          HW_ResponseHeld(Device))
+     HW_CollectResponse(Device, 0);
+    while((Device->RxCount >= 2) && HW_TakeEvent(Device, 0));
+
+    // Leave once nothing else can be queued
+    if(Device->Stopping && (QueryDepthSList(&Device->Queue) == 0)) break;
+   };
+
+  // Finish anything held or in flight and release the DLL
+  HW_FlushCombined(Device);
+  HW_CollectAll(Device);
+  module = Device->Module;
+  FreeLibraryAndExitThread(module, 0);
+  return(0);
+ } 
+
+/*--------------------------------------------------------------------------*/
+
+/* HW_RUNJOB runs one job on the executor thread.  A command is posted into 
+   the pipeline window and finishes when its response is collected.  A job
+   that nobody waits on was allocated when it was queued and is freed once
+   posted, while one with a callback is freed once called back.  A call 
+   runs its function and finishes straight away.  A pin write held for 
+   combining is freed once held, and any other job sends the pin writes 
+   held before it first.
+*/
+
+void HW_RunJob(HW_DEVICE *Device, HW_JOB *Job)
+ {
+  BYTE waited;
+
+  // Held pin writes go out before anything else, to keep everything in order
+  if(Job->Kind != HW_JOB_COMBINE) HW_FlushCombined(Device);
+
+  switch(Job->Kind)
+   {
+    case HW_JOB_COMMAND:
+     // The job can be finished and freed during the post, so look first
+     waited = ((Job->Done != NULL) || (Job->Callback != NULL)) ? 1 : 0;
+     Job->Request.Job = waited ? Job : NULL;
+     HW_PostCommand(Device, Job->Token, Job->Count, Job->Data, &Job->Request);
+     if(!waited) _aligned_free(Job);
+     break;
+
+    case HW_JOB_CALL:
+     HW_ClearError();
+     Job->Result = Job->Function(Device, Job->Context);
+     if(!Job->Result) HW_TakeError(&Job->Error);
+     SetEvent(Job->Done);
+     break;
+
+    case HW_JOB_COMBINE:
+     HW_Combine(Device, Job->Token, Job->Data);
+     _aligned_free(Job);
+     break;
+   };
+ } 
+
+/*--------------------------------------------------------------------------*/
+
+/* HW_QUEUEJOB hands a job to the executor of a device.  Any thread may 
+   queue jobs at any time without taking a lock.
+*/
+
+void HW_QueueJob(HW_DEVICE *Device, HW_JOB *Job)
+ {
+  InterlockedPushEntrySList(&Device->Queue, &Job->Entry);
+  SetEvent(Device->Wakeup);
+ } 
+
+/*--------------------------------------------------------------------------*/
+
+/* HW_EXECUTEJOB hands a job to the executor and waits for it to finish.
+   The 1/0 result of the job is returned.  If the job failed, the error the
+   executor found becomes the last error of the calling thread.
+*/
+
+DWORD HW_ExecuteJob(HW_DEVICE *Device, HW_JOB *Job)
+ {
+  HW_ERROR *error;
+
+  // Get the event this thread waits on
+  Job->Done = HW_ThreadEvent();
+  if(Job->Done == NULL) return(0);
+
+  // Queue the job and wait
+  Job->Error.Code = BHPMOD_ERROR_NONE;
+  HW_QueueJob(Device, Job);
+  WaitForSingleObject(Job->Done, INFINITE);
+
+  // Pass on the error without recording it again
+  error = HW_ThreadError();
+  if(!Job->Result && (Job->Error.Code != BHPMOD_ERROR_NONE) && (error != NULL)) *error = Job->Error;
+  return(Job->Result);
+ } 
+
+/*--------------------------------------------------------------------------*/
+
+/* HW_TRANSACT sends a command and waits for its response, which is 
+   interpreted according to the request.  The command is sent by the 
+   executor in turn with commands from other threads.  The 1/0 result 
+   of the request is returned.  
+*/
+
+DWORD HW_Transact(HW_DEVICE *Device, BYTE Token, BYTE Count, void *DataMessage, HW_REQUEST *Request)
+ {
+  HW_JOB job;
+
+  // Check arguments
+  if(Device == NULL) return(FailRequest(Request));
+  if(Count > 62) return(FailRequest(Request));
+  if((Count > 0) && (DataMessage == NULL)) return(FailRequest(Request));
+
+  // Describe the job and wait for it
+  job.Kind = HW_JOB_COMMAND;
+  job.Token = Token;
+  job.Count = Count;
+  if(Count > 0) memcpy(job.Data, DataMessage, Count);
+  job.Request = *Request;
+  job.Callback = NULL;
+  return(HW_ExecuteJob(Device, &job));
+ } 
+
+/*--------------------------------------------------------------------------*/
+
+/* HW_SUBMIT sends a command for an exported function.  If a pipeline is 
+   active and was begun by this thread, the command is only queued and a 1
+   is returned so the caller can go on while the response is pending.  
+   Otherwise this waits for the response and returns the result just like
+   HW_Transact.  Other threads are not affected by a pipeline.
+*/
+
+DWORD HW_Submit(HW_DEVICE *Device, BYTE Token, BYTE Count, void *DataMessage, HW_REQUEST *Request)
+ {
+  // Check arguments
+  if(Device == NULL) return(FailRequest(Request));
+  if(Count > 62) return(FailRequest(Request));
+  if((Count > 0) && (DataMessage == NULL)) return(FailRequest(Request));
+
+  // Wait unless this thread is pipelining
+  if(!Device->PipelineActive || (Device->PipelineOwner != GetCurrentThreadId()))
+   return(HW_Transact(Device, Token, Count, DataMessage, Request));
+
+  // Queue the command without waiting
+  return(HW_QueueCommand(Device, HW_JOB_COMMAND, Token, Count, DataMessage, Request));
+ } 
+
+/*--------------------------------------------------------------------------*/
+
+/* HW_POST sends a write command whose response is only a status.  If 
+   write combining is enabled, a pin write is queued to be held for 
+   combining and a 1 is returned.  If posted writes are enabled and this 
+   thread is not pipelining, the command is queued without waiting and a 1
+   is returned.  The executor collects the status as soon as it arrives, 
+   and holds the first failure for the next synchronous call or fence to 
+   report.  Otherwise this is the same as HW_Submit.
+*/
+
+DWORD HW_Post(HW_DEVICE *Device, BYTE Token, BYTE Count, void *DataMessage, HW_REQUEST *Request)
+ {
+  HW_REQUEST request;
+
+  // Check arguments
+  if(Device == NULL) return(FailRequest(Request));
+  if(Count > 62) return(FailRequest(Request));
+  if((Count > 0) && (DataMessage == NULL)) return(FailRequest(Request));
+
+  // Hold pin writes for combining
+  if(Device->Combining && (Count == 2) && (((BYTE *)DataMessage)[0] <= HW_MAX_SHADOW_PIN) &&
+     ((Token == TOKEN_COMMAND_PMOD_WRITE_PIN) || (Token == TOKEN_COMMAND_PMOD_SET_PIN_DRIVE)))
+   return(HW_QueueCommand(Device, HW_JOB_COMBINE, Token, Count, DataMessage, Request));
+
+  // Wait unless writes are posted, and let a pipeline of this thread take it
+  if(!Device->PostedWrites) return(HW_Transact(Device, Token, Count, DataMessage, Request));
+  if(Device->PipelineActive && (Device->PipelineOwner == GetCurrentThreadId()))
+   return(HW_QueueCommand(Device, HW_JOB_COMMAND, Token, Count, DataMessage, Request));
+
+  // Queue the command marked as posted
+  request = *Request;
+  request.Posted = 1;
+  return(HW_QueueCommand(Device, HW_JOB_COMMAND, Token, Count, DataMessage, &request));
+ } 
+
+/*--------------------------------------------------------------------------*/
+
+/* HW_QUEUECOMMAND queues a command job, or a pin write to hold for 
+   combining, that nobody waits on.  This is for HW_Submit and HW_Post once
+   the arguments are checked.  A 1 is returned if it was queued.
+*/
+
+DWORD HW_QueueCommand(HW_DEVICE *Device, BYTE Kind, BYTE Token, BYTE Count, void *DataMessage, HW_REQUEST *Request)
+ {
+  HW_JOB *job;
+
+  // The executor frees the job once the command is posted or held
+  job = (HW_JOB *)_aligned_malloc(sizeof(HW_JOB), MEMORY_ALLOCATION_ALIGNMENT);
+  if(job == NULL) return(FailRequest(Request));
+  job->Kind = Kind;
+  job->Token = Token;
+  job->Count = Count;
+  if(Count > 0) memcpy(job->Data, DataMessage, Count);
+  job->Request = *Request;
+  job->Done = NULL;
+  job->Callback = NULL;
+  HW_QueueJob(Device, job);
+  return(1);
+ } 
+
+/*--------------------------------------------------------------------------*/
+
+/* HW_SUBMITASYNC queues a command for an asynchronous export and returns 
+   without waiting.  The callback is made on the executor thread with the 
+   1/0 result once the response has been completed into the caller's 
+   arguments.  A 1 is returned if the command was queued, in which case the
+   callback is always made exactly once.  Otherwise a 0 is returned and no
+   callback is made.
+*/
+
+DWORD HW_SubmitAsync(HW_DEVICE *Device, BYTE Token, BYTE Count, void *DataMessage, HW_REQUEST *Request, BHPMOD_CALLBACK Callback, void *Context)
+ {
+  HW_JOB *job;
+
+  // Check arguments
+  if(Device == NULL) return(0);
+  if(Callback == NULL) return(0);
+  if(Count > 62) return(0);
+  if((Count > 0) && (DataMessage == NULL)) return(0);
+
+  // Queue the command
+  // The executor frees the job once it has called back
+  job = (HW_JOB *)_aligned_malloc(sizeof(HW_JOB), MEMORY_ALLOCATION_ALIGNMENT);
+  if(job == NULL) return(0);
+  job->Kind = HW_JOB_COMMAND;
+  job->Token = Token;
+  job->Count = Count;
+  if(Count > 0) memcpy(job->Data, DataMessage, Count);
+  job->Request = *Request;
+  job->Done = NULL;
+  job->Callback = Callback;
+  job->CallbackContext = Context;
+  HW_QueueJob(Device, job);
+  return(1);
+ } 
+
+/*--------------------------------------------------------------------------*/
+
+/* HW_CALL runs a function on the executor thread of a device and waits for 
+   it to finish.  This is for work that must not be interleaved with other
+   traffic, such as a series of raw packets, or that works on the pipeline 
+   window.  The 1/0 result of the function is returned.
+*/
+
+DWORD HW_Call(HW_DEVICE *Device, HW_FUNCTION Function, void *Context)
+ {
+  HW_JOB job;
+
+  if(Device == NULL) return(0);
+  job.Kind = HW_JOB_CALL;
+  job.Function = Function;
+  job.Context = Context;
+  job.Callback = NULL;
+  return(HW_ExecuteJob(Device, &job));
+ } 
+
+/*--------------------------------------------------------------------------*/
+
+/* HW_THREADEVENT returns the event the calling thread waits on for its jobs
+   to finish, creating it the first time.  NULL is returned if the event 
+   cannot be created.  The event is closed when the thread exits.
+*/
+
+HANDLE HW_ThreadEvent(void)
+ {
+  HANDLE event = (HANDLE)TlsGetValue(ThreadEventIndex);
+
+  if(event != NULL) return(event);
+  event = CreateEvent(NULL, FALSE, FALSE, NULL);
+  if(event == NULL) return(NULL);
+  TlsSetValue(ThreadEventIndex, event);
+  return(event);
+ } 
+
+/*--------------------------------------------------------------------------*/
+
+/* HW_TAKEERROR copies the last error of the calling thread, for a job that
+   failed on the executor thread to hand back to the thread waiting on it.
+*/
+
+void HW_TakeError(HW_ERROR *Error)
+ {
+  HW_ERROR *error = HW_ThreadError();
+
+  if(error != NULL) *Error = *error;
+  else HW_SetError(Error, BHPMOD_ERROR_NONE, NULL);
+ } 
+
+/*--------------------------------------------------------------------------*/
+
+/* HW_PIPELINEBEGIN, HW_PIPELINECOLLECT and HW_PIPELINEEND do the work of 
+   the exported pipeline functions on the executor thread.  The context is 
+   an array of arguments as described with each.
+*/
+
+// Context - window, owner thread ID
+DWORD HW_PipelineBegin(HW_DEVICE *Device, void *Context)
+ {
+  DWORD *args = (DWORD *)Context;
+  DWORD result = 1;
+
+  // Finish anything in flight with the previous window
+  if(Device->PipelineActive) result = HW_CollectAll(Device);
+
+  // Establish the new window
+  if(args[0] > HW_MAX_PIPELINE_WINDOW) args[0] = HW_MAX_PIPELINE_WINDOW;
+  if(args[0] > Device->Capabilities.CommandsHeld) args[0] = Device->Capabilities.CommandsHeld;
+  if(args[0] < 1) args[0] = 1;
+  Device->PipelineWindow = (BYTE)args[0];
+  Device->PipelineFailures = 0;
+  Device->PipelineOwner = args[1];
+  Device->PipelineActive = 1;
+
+  // Return the result
+  return(result);
+ }
+
+// Context - number of commands still in flight returned
+DWORD HW_PipelineCollect(HW_DEVICE *Device, void *Context)
+ {
+  DWORD *args = (DWORD *)Context;
+  DWORD result = 0;
+
+  // Commands of other threads and posted writes are finished on the way
+  while((Device->PipelineCount > 0) && HW_AWAITED(&Device->PipelineRequest[Device->PipelineHead]))
+   HW_CollectResponse(Device, 0);
+
+  // Collect the oldest response
+  if(Device->PipelineCount > 0) result = HW_CollectResponse(Device, 1);
+
+  // Return what remains and the result
+  args[0] = Device->PipelineCount;
+  return(result);
+ }
+
+// Context - number of failures returned
+DWORD HW_PipelineEnd(HW_DEVICE *Device, void *Context)
+ {
+  DWORD *args = (DWORD *)Context;
+
+  // Collect everything in flight and stop posting
+  HW_CollectAll(Device);
+  Device->PipelineActive = 0;
+  Device->PipelineOwner = 0;
+
+  // Return the failure count and result
+  args[0] = Device->PipelineFailures;
+  Device->PipelineFailures = 0;
+  return((args[0] == 0) ? 1 : 0);
+ }
+
+/*--------------------------------------------------------------------------*/
+
+/* HW_DISCOVER asks the device what its firmware can do and keeps the answer
+   in the device context, where the exported functions look to choose the 
+   fastest path the device has.  Firmware older than the capabilities 
+   command answers with an error status, and is taken to have none of the 
+   features and to hold one command, which is the baseline protocol.  So 
+   is a device that does not answer, and a 0 is returned in that case.  
+   Only the fields the response holds are taken, so later firmware can add
+   more.  Nothing may be in flight.
+*/
+
+// Context - not used
+DWORD HW_Discover(HW_DEVICE *Device, void *Context)
+ {
+  BHPMOD_CAPABILITIES *caps = &Device->Capabilities;
+  BYTE data[62];
+  BYTE token, cnt, size;
+
+  // Until the device says otherwise it has only the baseline protocol
+  memset(caps, 0, sizeof(BHPMOD_CAPABILITIES));
+  caps->CommandsHeld = 1;
+
+  if(!HW_SendDeviceCommand(Device, TOKEN_COMMAND_GET_CAPABILITIES, 0, NULL, 0, 0)) return(0);
+  cnt = 62;
+  if(!HW_GetDeviceResponse(Device, &token, &cnt, data)) return(0);
+  if(token != TOKEN_RESPONSE_CAPABILITIES) return(1);
+  if(cnt > 62) cnt = 62;
+
+  // Take each field the response is long enough to hold
+  if(cnt >= CAPABILITIES_FIRMWARE_VERSION + 1) 
+   caps->FirmwareVersion = data[CAPABILITIES_FIRMWARE_VERSION];
+  if(cnt >= CAPABILITIES_FEATURES + 2) 
+   caps->Features = MAKEWORD(data[CAPABILITIES_FEATURES + 1], data[CAPABILITIES_FEATURES]);
+  if((cnt >= CAPABILITIES_COMMANDS_HELD + 1) && (data[CAPABILITIES_COMMANDS_HELD] > 0)) 
+   caps->CommandsHeld = data[CAPABILITIES_COMMANDS_HELD];
+  if(cnt >= CAPABILITIES_MAX_SPI_RATE + 4)
+   caps->MaxSpiRate = MAKELONG(MAKEWORD(data[CAPABILITIES_MAX_SPI_RATE + 3], data[CAPABILITIES_MAX_SPI_RATE + 2]),
+                               MAKEWORD(data[CAPABILITIES_MAX_SPI_RATE + 1], data[CAPABILITIES_MAX_SPI_RATE]));
+  if(cnt >= CAPABILITIES_MAX_I2C_RATE + 4)
+   caps->MaxI2cRate = MAKELONG(MAKEWORD(data[CAPABILITIES_MAX_I2C_RATE + 3], data[CAPABILITIES_MAX_I2C_RATE + 2]),
+                               MAKEWORD(data[CAPABILITIES_MAX_I2C_RATE + 1], data[CAPABILITIES_MAX_I2C_RATE]));
+  if(cnt >= CAPABILITIES_MAX_I2C_BULK_PAGE + 2) 
+   caps->MaxI2cBulkPage = MAKEWORD(data[CAPABILITIES_MAX_I2C_BULK_PAGE + 1], data[CAPABILITIES_MAX_I2C_BULK_PAGE]);
+  if(cnt >= CAPABILITIES_SERIAL_BUFFER_SPACE + 2) 
+   caps->SerialBufferSpace = MAKEWORD(data[CAPABILITIES_SERIAL_BUFFER_SPACE + 1], data[CAPABILITIES_SERIAL_BUFFER_SPACE]);
+  if(cnt > CAPABILITIES_HARDWARE_VERSION)
+   {
+    size = cnt - CAPABILITIES_HARDWARE_VERSION;
+    if(size > BHPMOD_MAX_VERSION_LENGTH - 1) size = BHPMOD_MAX_VERSION_LENGTH - 1;
+    memcpy(caps->HardwareVersion, &data[CAPABILITIES_HARDWARE_VERSION], size);
+   };
+  return(1);
+ }
+
+/*--------------------------------------------------------------------------*/
+
+/* HW_SEQUENCING does the work of BHPMOD_SetSequencingEx on the executor 
+   thread.  Support is found by sending a get status command with a 
+   sequence number, since firmware without support answers with an error 
+   status that has none.
+*/
+
+// Context - 1/0 to use sequence numbers or not
+DWORD HW_Sequencing(HW_DEVICE *Device, void *Context)
+ {
+  DWORD *args = (DWORD *)Context;
+  BYTE token, cnt, status, sequence;
+  BYTE supported;
+
+  // Nothing may be in flight while the framing changes
+  HW_CollectAll(Device);
+  Device->Sequencing = 0;
+  if(!args[0]) return(1);
+
+  // Ask with a numbered command and see if the number comes back
+  if(Device->Broken && !HW_Reconnect(Device)) return(0);
+  if(!HW_SUPPORTS(Device, CAPABILITY_BIT_SEQUENCE)) return(ErrorNotSupported());
+  sequence = Device->SequenceNext++;
+  if(!HW_SendDeviceCommand(Device, TOKEN_COMMAND_GET_STATUS, 0, NULL, 1, sequence)) return(0);
+  if(!HW_FillReceive(Device, 2) || !HW_FillReceive(Device, RX_HEADER(Device)))
+   {
+    HW_FlushReceive(Device);
+    return(ErrorNoResponse());
+   };
+  supported = ((RX_HEADER(Device) == 3) && (RX_PEEK(Device, 2) == sequence)) ? 1 : 0;
+  cnt = 1;
+  if(!HW_GetDeviceResponse(Device, &token, &cnt, &status)) return(ErrorNoResponse());
+  if(!supported || (token != TOKEN_RESPONSE_STATUS)) return(ErrorNotSupported());
+
+  // Number every command from here on
+  Device->Sequencing = 1;
+  return(1);
+ }
+
+/*--------------------------------------------------------------------------*/
+
+/* HW_SPIBULK does the work of BHPMOD_SPI_BulkTransactionEx on the executor
+   thread.  The bulk command opens a data phase on the device, then each 
+   packet of write data goes out raw and the bytes read come back raw in a
+   packet of the same size before the next is sent.  The device sends 
+   status once the whole length has been transferred.
+*/
+
+// Context - pointer to the length, then the write and read buffers
+DWORD HW_SpiBulk(HW_DEVICE *Device, void *Context)
+ {
+  void **args = (void **)Context;
+  DWORD length = *(DWORD *)args[0];
+  BYTE *write = (BYTE *)args[1];
+  BYTE *read = (BYTE *)args[2];
+  BYTE packet[64];
+  BYTE buf[2];
+  BYTE token, cnt, status;
+  DWORD done, size, i, WrCnt;
+
+  // Raw data cannot be told from responses, so nothing else may be in flight
+  HW_CollectAll(Device);
+  if(Device->Broken && !HW_Reconnect(Device)) return(0);
+  if(!HW_SUPPORTS(Device, CAPABILITY_BIT_SPI_BULK)) return(HW_SpiBulkBaseline(Device, length, write, read));
+
+  // Open the data phase, which selects the SPI device
+  buf[0] = HIBYTE(length);
+  buf[1] = LOBYTE(length);
+  if(!HW_SendDeviceCommand(Device, TOKEN_COMMAND_SPI_BULK, 2, buf, 0, 0)) return(0);
+  cnt = 1;
+  if(!HW_GetDeviceResponse(Device, &token, &cnt, &status)) return(ErrorNoResponse());
+  if(token != TOKEN_RESPONSE_STATUS) return(ErrorBadResponse());
+  if(!(status & STATUS_BIT_DATA_OUT_PHASE)) return(ErrorCommandFailed());
+
+  // Send each packet and take the bytes read in its place before the next
+  for(done = 0; done < length; done += size)
+   {
+    size = (length - done < 64) ? length - done : 64;
+    if(write != NULL) memcpy(packet, &write[done], size); else memset(packet, 0xFF, size);
+    if(SI_Write(Device->Handle, packet, size, &WrCnt) != SI_SUCCESS)
+     {
+      Device->Broken = 1;
+      return(ErrorInternal());
+     };
+    if(!HW_FillReceive(Device, size))
+     {
+      HW_FlushReceive(Device);
+      return(ErrorNoResponse());
+     };
+    if(read != NULL)
+     for(i = 0; i < size; i++) read[done + i] = RX_PEEK(Device, i);
+    Device->RxHead = (Device->RxHead + size) & HW_RX_RING_MASK;
+    Device->RxCount -= size;
+   };
+
+  // The device is back in command mode when it sends status
+  cnt = 1;
+  if(!HW_GetDeviceResponse(Device, &token, &cnt, &status)) return(ErrorNoResponse());
+  if(token != TOKEN_RESPONSE_STATUS) return(ErrorBadResponse());
+  return(1);
+ }
+
+/*--------------------------------------------------------------------------*/
+
+/* HW_SPIBULKBASELINE does a bulk transaction on firmware without the bulk
+   command.  Chip select must stay active for the whole transfer, so only
+   what fits in one ordinary transaction can be done.  A transaction that 
+   comes back short means the PMOD is not configured for SPI.
+*/
+
+DWORD HW_SpiBulkBaseline(HW_DEVICE *Device, DWORD Length, BYTE *Write, BYTE *Read)
+ {
+  BYTE buf[62];
+  BYTE cnt;
+  HW_REQUEST request = { TOKEN_RESPONSE_SPI_TRANSACTION, HW_RESPONSE_DATA, 0, &cnt, buf };
+
+  if(Length > 62) return(ErrorNotSupported());
+  if(Write != NULL) memcpy(buf, Write, Length); else memset(buf, 0xFF, Length);
+  request.Limit = (BYTE)Length;
+  if(!HW_ExchangeRequest(Device, TOKEN_COMMMAND_SPI_TRANSACTION, (BYTE)Length, buf, &request)) return(0);
+  if(cnt != Length) return(ErrorCommandFailed());
+  if(Read != NULL) memcpy(Read, buf, Length);
+  return(1);
+ }
+
+/*--------------------------------------------------------------------------*/
+
+/* HW_I2CBULKWRITE does the work of BHPMOD_I2C_BulkWriteEx on the executor
+   thread.  The bulk command opens a data phase on the device, then each 
+   packet of data goes out raw and the device answers with status once it
+   has written it, asking for more until the whole length is written.
+*/
+
+// Context - pointer to the command data, then to the length, then the content
+DWORD HW_I2cBulkWrite(HW_DEVICE *Device, void *Context)
+ {
+  void **args = (void **)Context;
+  DWORD length = *(DWORD *)args[1];
+  BYTE *content = (BYTE *)args[2];
+  BYTE token, cnt, status;
+  DWORD done, size, WrCnt;
+
+  // Raw data cannot be told from responses, so nothing else may be in flight
+  HW_CollectAll(Device);
+  if(Device->Broken && !HW_Reconnect(Device)) return(0);
+  if(!HW_SUPPORTS(Device, CAPABILITY_BIT_I2C_BULK)) return(HW_I2cBulkWriteBaseline(Device, (BYTE *)args[0], length, content));
+
+  // Open the data phase
+  if(!HW_SendDeviceCommand(Device, TOKEN_COMMAND_I2C_BULK_WRITE, 8, args[0], 0, 0)) return(0);
+  cnt = 1;
+  if(!HW_GetDeviceResponse(Device, &token, &cnt, &status)) return(ErrorNoResponse());
+  if(token != TOKEN_RESPONSE_STATUS) return(ErrorBadResponse());
+  if(!(status & STATUS_BIT_DATA_OUT_PHASE)) return(ErrorCommandFailed());
+
+  // Send each packet and wait for the device to write it before the next
+  for(done = 0; done < length; done += size)
+   {
+    size = (length - done < 64) ? length - done : 64;
+    if(SI_Write(Device->Handle, &content[done], size, &WrCnt) != SI_SUCCESS)
+     {
+      Device->Broken = 1;
+      return(ErrorInternal());
+     };
+    cnt = 1;
+    if(!HW_GetDeviceResponse(Device, &token, &cnt, &status)) return(ErrorNoResponse());
+    if(token != TOKEN_RESPONSE_STATUS) return(ErrorBadResponse());
+    if(status & STATUS_BIT_ERROR) return(ErrorCommandFailed());
+
+    // The device asks for more until the last packet, then is back in command mode
+    if(((status & STATUS_BIT_DATA_OUT_PHASE) != 0) != (done + size < length)) return(ErrorBadResponse());
+   };
+  return(1);
+ }
+
+/*--------------------------------------------------------------------------*/
+
+/* HW_I2CBULKWRITEBASELINE does a bulk write on firmware without the bulk 
+   write command, as ordinary writes that split the data the same way the
+   device would and advance the subaddress by each.  A part still busy 
+   with the last piece does not acknowledge, so a piece not written at all
+   is tried again for a while.  Without a subaddress there is nothing to 
+   advance, so only what fits in one write can be done, and a subaddress 
+   is not advanced past its last value, since the part would not follow.
+*/
+
+// Command - bulk write command data as built by BHPMOD_I2C_BulkWriteEx
+DWORD HW_I2cBulkWriteBaseline(HW_DEVICE *Device, BYTE *Command, DWORD Length, BYTE *Content)
+ {
+  BYTE buf[62];
+  BYTE cnt;
+  HW_REQUEST request = { TOKEN_RESPONSE_I2C_WRITE, HW_RESPONSE_I2C_WRITE, 0, &cnt, NULL };
+  DWORD subaddr, page, done, size, start;
+
+  // Pieces stop at each page boundary as they would on the device
+  subaddr = (Command[1] == 2) ? MAKEWORD(Command[3], Command[2]) : Command[2];
+  page = MAKEWORD(Command[7], Command[6]);
+  if((page == 0) || (page > 128)) page = 128;
+  if((Command[1] == 0) && (Length > 57)) return(ErrorNotSupported());
+  if((Command[1] > 0) && (subaddr + Length > ((DWORD)1 << (8 * Command[1])))) return(ErrorBadLength());
+
+  for(done = 0; done < Length; done += size)
+   {
+    size = (Length - done < 57) ? Length - done : 57;
+    if((Command[1] > 0) && (size > page - (subaddr % page))) size = page - (subaddr % page);
+    buf[0] = Command[0];
+    buf[1] = Command[1];
+    buf[2] = (Command[1] == 2) ? HIBYTE(subaddr) : LOBYTE(subaddr);
+    buf[3] = (Command[1] == 2) ? LOBYTE(subaddr) : 0;
+    buf[4] = (BYTE)size;
+    memcpy(&buf[5], &Content[done], size);
+
+    // Poll until the part takes the piece
+    start = GetTickCount();
+    do
+     if(!HW_ExchangeRequest(Device, TOKEN_COMMAND_I2C_WRITE, (BYTE)size + 5, buf, &request)) return(0);
+    while((cnt == 0) && (GetTickCount() - start < HW_I2C_WRITE_TIME));
+    if(cnt != size) return(ErrorCommandFailed());
+    subaddr += size;
+   };
+  return(1);
+ }
+
+/*--------------------------------------------------------------------------*/
+
+/* HW_I2CBULKREAD does the work of BHPMOD_I2C_BulkReadEx on the executor 
+   thread.  The bulk command opens a data phase on the device, which then 
+   sends the whole length raw followed by status.
+*/
+
+// Context - pointer to the command data, then to the length, then the content
+DWORD HW_I2cBulkRead(HW_DEVICE *Device, void *Context)
+ {
+  void **args = (void **)Context;
+  DWORD length = *(DWORD *)args[1];
+  BYTE *content = (BYTE *)args[2];
+  BYTE token, cnt, status;
+  DWORD done, size, i;
+
+  // Raw data cannot be told from responses, so nothing else may be in flight
+  HW_CollectAll(Device);
+  if(Device->Broken && !HW_Reconnect(Device)) return(0);
+  if(!HW_SUPPORTS(Device, CAPABILITY_BIT_I2C_BULK)) return(HW_I2cBulkReadBaseline(Device, (BYTE *)args[0], length, content));
+
+  // Open the data phase, which addresses the I2C device
+  if(!HW_SendDeviceCommand(Device, TOKEN_COMMAND_I2C_BULK_READ, 6, args[0], 0, 0)) return(0);
+  cnt = 1;
+  if(!HW_GetDeviceResponse(Device, &token, &cnt, &status)) return(ErrorNoResponse());
+  if(token != TOKEN_RESPONSE_STATUS) return(ErrorBadResponse());
+  if(!(status & STATUS_BIT_DATA_IN_PHASE)) return(ErrorCommandFailed());
+
+  // Take the data a packet at a time as they arrive
+  for(done = 0; done < length; done += size)
+   {
+    size = (length - done < 64) ? length - done : 64;
+    if(!HW_FillReceive(Device, size))
+     {
+      HW_FlushReceive(Device);
+      return(ErrorNoResponse());
+     };
+    for(i = 0; i < size; i++) content[done + i] = RX_PEEK(Device, i);
+    Device->RxHead = (Device->RxHead + size) & HW_RX_RING_MASK;
+    Device->RxCount -= size;
+   };
+
+  // The device is back in command mode when it sends status
+  cnt = 1;
+  if(!HW_GetDeviceResponse(Device, &token, &cnt, &status)) return(ErrorNoResponse());
+  if(token != TOKEN_RESPONSE_STATUS) return(ErrorBadResponse());
+  if(status & STATUS_BIT_ERROR) return(ErrorCommandFailed());
+  return(1);
+ }
+
+/*--------------------------------------------------------------------------*/
+
+/* HW_I2CBULKREADBASELINE does a bulk read on firmware without the bulk 
+   read command, as ordinary reads that advance the subaddress by each.  
+   Each piece is its own I2C transaction, which suits memories but not a
+   part that streams data without a subaddress, so without one only what
+   fits in one read can be done.  A subaddress is not advanced past its 
+   last value, as a 1 byte subaddress past 0xFF would read from 0 again.
+*/
+
+// Command - bulk read command data as built by BHPMOD_I2C_BulkReadEx
+DWORD HW_I2cBulkReadBaseline(HW_DEVICE *Device, BYTE *Command, DWORD Length, BYTE *Content)
+ {
+  BYTE buf[5];
+  BYTE cnt;
+  HW_REQUEST request = { TOKEN_RESPONSE_I2C_READ, HW_RESPONSE_I2C_READ, 0, &cnt, NULL };
+  DWORD subaddr, done, size;
+
+  subaddr = (Command[1] == 2) ? MAKEWORD(Command[3], Command[2]) : Command[2];
+  if((Command[1] == 0) && (Length > 57)) return(ErrorNotSupported());
+  if((Command[1] > 0) && (subaddr + Length > ((DWORD)1 << (8 * Command[1])))) return(ErrorBadLength());
+
+  for(done = 0; done < Length; done += size)
+   {
+    size = (Length - done < 57) ? Length - done : 57;
+    buf[0] = Command[0];
+    buf[1] = Command[1];
+    buf[2] = (Command[1] == 2) ? HIBYTE(subaddr) : LOBYTE(subaddr);
+    buf[3] = (Command[1] == 2) ? LOBYTE(subaddr) : 0;
+    buf[4] = (BYTE)size;
+    request.Limit = (BYTE)size;
+    request.Content = &Content[done];
+    if(!HW_ExchangeRequest(Device, TOKEN_COMMAND_I2C_READ, 5, buf, &request)) return(0);
+    if(cnt != size) return(ErrorCommandFailed());
+    subaddr += size;
+   };
+  return(1);
+ }
+
+/*--------------------------------------------------------------------------*/
+
+/* HW_SERIALSTREAM does the work of BHPMOD_SERIAL_StreamEx on the executor 
+   thread.  The free space the device last reported, less what has been 
+   sent since, is the credit for sending more.  Packets go out, cut to the
+   credit, while there is any credit and room in the window, and otherwise
+   the oldest acknowledgement is collected to renew the credit.  With 
+   nothing in flight and no credit, an empty packet asks for the space 
+   again after a pause.  If no credit comes for as long as a response may
+   take, the port is not sending, and this fails.
+*/
+
+// Context - pointer to the length, then the content
+DWORD HW_SerialStream(HW_DEVICE *Device, void *Context)
+ {
+  void **args = (void **)Context;
+  DWORD length = *(DWORD *)args[0];
+  BYTE *content = (BYTE *)args[1];
+  BYTE sizes[HW_STREAM_WINDOW];
+  BYTE ack[3];
+  BYTE token, cnt, size, asked;
+  DWORD done, first, pending, credit, progress, i;
+
+  // Acknowledgements cannot be matched to packets if anything else is in flight
+  HW_CollectAll(Device);
+  if(Device->Broken && !HW_Reconnect(Device)) return(0);
+  if(!HW_SUPPORTS(Device, CAPABILITY_BIT_SERIAL_STREAM)) return(HW_SerialStreamBaseline(Device, length, content));
+
+  // Start with no credit, which asks the device for its space
+  done = 0;
+  first = 0;
+  pending = 0;
+  credit = 0;
+  asked = 0;
+  progress = GetTickCount();
+  while((done < length) || (pending > 0))
+   {
+    size = (BYTE)((length - done < 62) ? length - done : 62);
+    if(size > credit) size = (BYTE)credit;
+
+    // Send while there is credit, as much of the packet as it covers
+    if((size > 0) && (pending < HW_STREAM_WINDOW))
+     {
+      progress = GetTickCount();
+      if(!HW_SendDeviceCommand(Device, TOKEN_COMMAND_SERIAL_STREAM, size, &content[done], 0, 0)) return(0);
+      sizes[(first + pending) % HW_STREAM_WINDOW] = size;
+      pending += 1;
+      credit -= size;
+      done += size;
+      continue;
+     };
+
+    // Ask for the space again if there is nothing to renew the credit, unless the port has stopped
+    if(pending == 0)
+     {
+      if(GetTickCount() - progress >= HW_RESPONSE_TIMEOUT) return(ErrorCommandFailed());
+      if(asked) Sleep(1);
+      if(!HW_SendDeviceCommand(Device, TOKEN_COMMAND_SERIAL_STREAM, 0, NULL, 0, 0)) return(0);
+      asked = 1;
+      sizes[first] = 0;
+      pending = 1;
+     };
+
+    // Collect the oldest acknowledgement, which must show all of its packet was taken
+    cnt = 3;
+    if(!HW_GetDeviceResponse(Device, &token, &cnt, ack)) return(ErrorNoResponse());
+    if(token == TOKEN_RESPONSE_STATUS) return(ErrorCommandFailed());
+    if((token != TOKEN_RESPONSE_SERIAL_STREAM) || (cnt != 3)) return(ErrorBadResponse());
+    if(ack[0] != sizes[first]) return(ErrorBadResponse());
+    first = (first + 1) % HW_STREAM_WINDOW;
+    pending -= 1;
+
+    // The space reported was before the packets still in flight were taken
+    credit = MAKEWORD(ack[2], ack[1]);
+    for(i = 0; i < pending; i++) 
+     credit = (credit > sizes[(first + i) % HW_STREAM_WINDOW]) ? credit - sizes[(first + i) % HW_STREAM_WINDOW] : 0;
+   };
+  return(1);
+ }
+
+/*--------------------------------------------------------------------------*/
+
+/* HW_SERIALSTREAMBASELINE sends a stream on firmware without the stream 
+   command, one ordinary write at a time.  Each write waits for its echo 
+   and reports how much the device took, so the rest is sent again after 
+   a pause when the buffer is full.  If nothing is taken for as long as a 
+   response may take, the port is not sending, or the PMOD is not 
+   configured for serial, and this fails.
+*/
+
+DWORD HW_SerialStreamBaseline(HW_DEVICE *Device, DWORD Length, BYTE *Content)
+ {
+  BYTE cnt;
+  HW_REQUEST request = { TOKEN_RESPONSE_SERIAL_WRITE, HW_RESPONSE_COUNT, 0, &cnt, NULL };
+  DWORD done, size, progress;
+
+  progress = GetTickCount();
+  for(done = 0; done < Length; done += cnt)
+   {
+    size = (Length - done < 62) ? Length - done : 62;
+    if(!HW_ExchangeRequest(Device, TOKEN_COMMAND_SERIAL_WRITE, (BYTE)size, &Content[done], &request)) return(0);
+    if(cnt > size) return(ErrorBadResponse());
+    if(cnt > 0) progress = GetTickCount();
+    else if(GetTickCount() - progress >= HW_RESPONSE_TIMEOUT) return(ErrorCommandFailed());
+    else Sleep(1);
+   };
+  return(1);
+ }
+
+/*--------------------------------------------------------------------------*/
+
+/* HW_SERIALEVENTS does the work of BHPMOD_SERIAL_SetEventsEx on the executor
+   thread.  The callback is changed between responses, so each packet of 
+   bytes goes either to the old callback or to the new one.  The setting is
+   kept for restoring after a reconnect once the device has accepted it.
+*/
+
+// Context - pointer to the command data, then the callback, then its context
+DWORD HW_SerialEvents(HW_DEVICE *Device, void *Context)
+ {
+  void **args = (void **)Context;
+  BYTE *cmd = (BYTE *)args[0];
+  BYTE token, cnt, status;
+
+  // Nothing else may be in flight for the exchange
+  HW_CollectAll(Device);
+  if(Device->Broken && !HW_Reconnect(Device)) return(0);
+  Device->SerialCallback = *(BHPMOD_SERIAL_CALLBACK *)args[1];
+  Device->SerialContext = args[2];
+
+  // Set the device and check that it accepted
+  if(!HW_SendDeviceCommand(Device, TOKEN_COMMAND_SET_SERIAL_EVENTS, 3, cmd, 0, 0)) return(0);
+  cnt = 1;
+  if(!HW_GetDeviceResponse(Device, &token, &cnt, &status)) return(ErrorNoResponse());
+  if((token != TOKEN_RESPONSE_STATUS) || (cnt != 1)) return(ErrorBadResponse());
+  if(status & STATUS_BIT_ERROR) return(ErrorCommandFailed());
+  HW_Shadow(Device, TOKEN_COMMAND_SET_SERIAL_EVENTS, 3, cmd);
+  Device->SerialEvents = (cmd[0] != 0) ? 1 : 0;
+  return(1);
+ }
+
+/*--------------------------------------------------------------------------*/
+
+/* HW_ACQUISITION does the work of BHPMOD_ACQ_StartEx and BHPMOD_ACQ_StopEx
+   on the executor thread.  A new job starts its timestamps from 0, and is 
+   kept for restoring after a reconnect once the device has accepted it.
+*/
+
+// Context - the command data of up to 62 bytes, then its count in byte 62
+DWORD HW_Acquisition(HW_DEVICE *Device, void *Context)
  {
-  DWORD Arg1, Arg2;
-  BYTE test_packet[100];
-  BYTE token = 0;
-  BYTE count = 0;
-
-  // MessageBox(NULL, "BHPMOD_TestCode", "", MB_TASKMODAL);
+  BYTE *cmd = (BYTE *)Context;
+  BYTE token, cnt, status;
 
-  // Get values in arguments
-  if(ArgStr1 == NULL) Arg1 = 0; else sscanf(ArgStr1, "%08X", &Arg1);
-  if(ArgStr2 == NULL) Arg2 = 0; else sscanf(ArgStr2, "%08X", &Arg2);
+  // Nothing else may be in flight for the exchange
+  HW_CollectAll(Device);
+  if(Device->Broken && !HW_Reconnect(Device)) return(0);
 
-  // Load the test number in the first data byte - embedded test code would use this
-  test_packet[0] = TestNumber;
-  
-  // Do the prescribed test
-  switch(TestNumber)
+  // Set the device and check that it accepted
+  if(!HW_SendDeviceCommand(Device, TOKEN_COMMAND_SET_ACQUISITION, cmd[62], cmd, 0, 0)) return(0);
+  cnt = 1;
+  if(!HW_GetDeviceResponse(Device, &token, &cnt, &status)) return(ErrorNoResponse());
+  if((token != TOKEN_RESPONSE_STATUS) || (cnt != 1)) return(ErrorBadResponse());
+  if(status & STATUS_BIT_ERROR) return(ErrorCommandFailed());
+  HW_Shadow(Device, TOKEN_COMMAND_SET_ACQUISITION, cmd[62], cmd);
+  if(cmd[62] > 2)
    {
-    case 0: 
-     break;
+    Device->AcqStamp = 0;
+    Device->AcqTime = 0;
+   };
+  return(1);
+ }
 
-    case 1:
-     break;
+/*--------------------------------------------------------------------------*/
 
-    case 2:
-     break;
+/* HW_READSAMPLES does the work of BHPMOD_ACQ_ReadEx on the executor thread.
+   Samples are read until the device has no more or the caller's buffers 
+   are full.  The device timestamps wrap every 65 seconds, so each is taken
+   as following the one before, which holds as long as no more than that 
+   passes between one sample kept and the next.
+*/
 
-    case 90:
-     // Poke xdata
-     test_packet[1] = HIBYTE(LOWORD(Arg1));
-     test_packet[2] = LOBYTE(LOWORD(Arg1));
-     test_packet[3] = LOBYTE(LOWORD(Arg2));
-     HW_SendDeviceCommand(TOKEN_COMMAND_TEST, 4, test_packet);
-     Arg2 = test_packet[3];
-     break;
+// Context - pointers to the count, the timestamps, the samples and the lost count
+DWORD HW_ReadSamples(HW_DEVICE *Device, void *Context)
+ {
+  void **args = (void **)Context;
+  DWORD *count = (DWORD *)args[0];
+  DWORD *timestamps = (DWORD *)args[1];
+  BYTE *samples = (BYTE *)args[2];
+  DWORD *lost = (DWORD *)args[3];
+  DWORD limit, done;
+  BYTE data[62];
+  BYTE token, cnt, want, n, size, i;
+  BYTE *record;
+  WORD stamp, waiting;
+
+  // Nothing else may be in flight for the exchanges
+  HW_CollectAll(Device);
+  if(Device->Broken && !HW_Reconnect(Device)) return(0);
+
+  limit = *count;
+  done = 0;
+  *count = 0;
+  do
+   {
+    // Ask for what is left of the caller's room
+    want = (limit - done > 255) ? 255 : (BYTE)(limit - done);
+    if(!HW_SendDeviceCommand(Device, TOKEN_COMMAND_READ_SAMPLES, 1, &want, 0, 0)) return(0);
+    cnt = 62;
+    if(!HW_GetDeviceResponse(Device, &token, &cnt, data)) return(ErrorNoResponse());
+    if((token != TOKEN_RESPONSE_SAMPLES) || (cnt < 5)) return(ErrorBadResponse());
+    n = data[0];
+    size = data[1];
+    if((n > want) || (cnt != 5 + (n * (2 + size)))) return(ErrorBadResponse());
+    *lost += data[2];
+    waiting = MAKEWORD(data[4], data[3]);
+
+    // Carry each timestamp on from the last
+    for(i = 0; i < n; i++)
+     {
+      record = &data[5 + (i * (2 + size))];
+      stamp = MAKEWORD(record[1], record[0]);
+      Device->AcqTime += (WORD)(stamp - Device->AcqStamp);
+      Device->AcqStamp = stamp;
+      timestamps[done] = Device->AcqTime;
+      memcpy(&samples[done * size], &record[2], size);
+      done += 1;
+      *count = done;
+     };
+   }
+  while((n > 0) && (waiting > 0) && (done < limit));
+  return(1);
+ }
 
-    case 91:
-     // Peek xdata
-     test_packet[1] = HIBYTE(LOWORD(Arg1));
-     test_packet[2] = LOBYTE(LOWORD(Arg1));
-     HW_SendDeviceCommand(TOKEN_COMMAND_TEST, 3, test_packet);
-     count = 1;
-     HW_GetDeviceResponse(&token, &count, test_packet);
-     Arg2 = test_packet[0];
-     break;
+/*--------------------------------------------------------------------------*/
 
-    case 99:
-     // Change test mode
-     test_packet[1] = LOBYTE(LOWORD(Arg1));
-     HW_SendDeviceCommand(TOKEN_COMMAND_TEST, 2, test_packet);
-     break;
+/* HW_SAMPLEEVENTS does the work of BHPMOD_STREAM_StartEx and 
+   BHPMOD_STREAM_StopEx on the executor thread.  Starting makes a new ring
+   before the device is asked, so nothing pushed is missed, and clears the
+   counters.  Stopping keeps the ring so what it holds can still be taken.
+   The setting is kept for restoring after a reconnect once the device has
+   accepted it.
+*/
 
-    default:
-     Arg1 = 0xBAD00001;
-     Arg2 = 0xBAD00002;
-     break;
+// Context - the threshold and latency as the high and low words, then the ring depth (0 to stop)
+DWORD HW_SampleEvents(HW_DEVICE *Device, void *Context)
+ {
+  DWORD *args = (DWORD *)Context;
+  BHPMOD_SAMPLE *ring;
+  DWORD depth;
+  BYTE cmd[3];
+  BYTE token, cnt, status;
+
+  // Nothing else may be in flight for the exchange
+  HW_CollectAll(Device);
+  if(Device->Broken && !HW_Reconnect(Device)) return(0);
+
+  // A new ring with nothing in it and the packets numbered from 0
+  if(args[1] != 0)
+   {
+    for(depth = 1; depth < args[1]; depth <<= 1);
+    ring = (BHPMOD_SAMPLE *)malloc(depth * sizeof(BHPMOD_SAMPLE));
+    if(ring == NULL) return(ErrorInternal());
+    free(Device->SampleRing);
+    Device->SampleRing = ring;
+    Device->SampleMask = depth - 1;
+    Device->SampleHead = 0;
+    Device->SampleTail = 0;
+    Device->SampleSequence = 0;
+    Device->SamplesLost = 0;
+    Device->SamplesMissed = 0;
+    Device->SamplesDropped = 0;
    };
 
-  // Write back given arguments
-  if(ArgStr1 != NULL) sprintf(ArgStr1, "%08X", Arg1);
-  if(ArgStr2 != NULL) sprintf(ArgStr2, "%08X", Arg2);
-
-  // Return success
+  // Set the device and check that it accepted
+  cmd[0] = (BYTE)HIWORD(args[0]);
+  cmd[1] = HIBYTE(LOWORD(args[0]));
+  cmd[2] = LOBYTE(LOWORD(args[0]));
+  if(!HW_SendDeviceCommand(Device, TOKEN_COMMAND_SET_SAMPLE_EVENTS, 3, cmd, 0, 0)) return(0);
+  cnt = 1;
+  if(!HW_GetDeviceResponse(Device, &token, &cnt, &status)) return(ErrorNoResponse());
+  if((token != TOKEN_RESPONSE_STATUS) || (cnt != 1)) return(ErrorBadResponse());
+  if(status & STATUS_BIT_ERROR) return(ErrorCommandFailed());
+  HW_Shadow(Device, TOKEN_COMMAND_SET_SAMPLE_EVENTS, 3, cmd);
+  Device->SampleEvents = (cmd[0] != 0) ? 1 : 0;
   return(1);
- } 
+ }
 
 /*--------------------------------------------------------------------------*/
-/* Hardware Support Functions                                               */
+
+/* HW_POSTEDWRITES and HW_FENCE do the work of the exported posted write 
+   functions on the executor thread.  Turning posted writes off fences.
+*/
+
+// Context - 1/0 to post writes or not
+DWORD HW_PostedWrites(HW_DEVICE *Device, void *Context)
+ {
+  DWORD *args = (DWORD *)Context;
+  DWORD result = 1;
+
+  if(!args[0]) result = HW_Fence(Device, NULL);
+  Device->PostedWrites = args[0] ? 1 : 0;
+  return(result);
+ }
+
+// Context - not used
+DWORD HW_Fence(HW_DEVICE *Device, void *Context)
+ {
+  // Collect everything in flight, then report any posted write failure
+  HW_CollectAll(Device);
+  if(Device->PostedFailed) return(HW_ReportPosted(Device));
+  return(1);
+ }
+
 /*--------------------------------------------------------------------------*/
 
-/* HW_OPEN identifies an attached BHPMOD and opens a handle to it.
+/* HW_REPORTPOSTED makes the held posted write failure the last error of the
+   calling thread and clears it, so that it is reported once.  The error 
+   was logged when it happened, so it is not logged again.  A 0 is returned
+   for convenience.
+*/
+
+DWORD HW_ReportPosted(HW_DEVICE *Device)
+ {
+  HW_ERROR *error = HW_ThreadError();
+
+  Device->PostedFailed = 0;
+  if(error != NULL) HW_SetError(error, BHPMOD_ERROR_POSTED, Device->PostedError.Detail);
+  return(0);
+ } 
+
+/*--------------------------------------------------------------------------*/
 
+/* HW_WRITECOMBINING and HW_FLUSH do the work of the exported write 
+   combining functions on the executor thread.  Pin writes held for 
+   combining are always sent before a call job runs, so by the time either
+   runs, there is nothing held.
 */
 
-DWORD HW_Open(void)
+// Context - 1/0 to combine pin writes or not
+DWORD HW_WriteCombining(HW_DEVICE *Device, void *Context)
  {
-  DWORD NumDevices, devindex;
-  WORD deviceid;
-  BYTE device_found;
-  char devidstr[100];
-  SI_STATUS status;
-  
-  // MessageBox(NULL, "HW_Open", "", MB_TASKMODAL);
+  DWORD *args = (DWORD *)Context;
 
-  // Set the driver default timeouts
-  // Note that some operations may take a certain amount of time to
-  // respond by design
-  SI_SetTimeouts(2000, 2000);
+  Device->Combining = args[0] ? 1 : 0;
+  return(1);
+ }
 
-  // Get the number of devices on the bus which use this driver
-  status = SI_GetNumDevices(&NumDevices);
-  if(status != SI_SUCCESS) return(ErrorMessage("Unable to access device driver", "Device Not Found"));
+// Context - not used
+DWORD HW_Flush(HW_DEVICE *Device, void *Context)
+ {
+  HW_FlushCombined(Device);
+  return(1);
+ }
 
-  // Look for the BHPMOD in the group
-  devindex=0;
-  do
-   {
-    device_found = 1;
-    // Get and match the VID of a device
-    SI_GetProductString(devindex, devidstr, SI_RETURN_VID);
-    sscanf(devidstr, "%hX", &deviceid);
-    if(deviceid != BHPMOD_VENDOR_ID) device_found = 0;
-    // Get and match the PID of a device
-    SI_GetProductString(devindex, devidstr, SI_RETURN_PID);
-    sscanf(devidstr, "%hX", &deviceid);
-    if(deviceid != BHPMOD_PRODUCT_ID) device_found = 0;
+/*--------------------------------------------------------------------------*/
 
-    // If this device is what we are looking for, try to open it
-    if(device_found)
-     {
-      status = SI_Open(devindex, &hBHPMOD);
-      if(status != SI_SUCCESS) return(ErrorMessage("Unable to open driver", "Device Not Found"));
-      return(1);
-     };
+/* HW_COMBINE holds a pin state or drive write for combining.  A later write
+   to the same pin replaces it.  The delay before the held writes are sent 
+   runs from the first write held.
+*/
 
-    // If not, then look at the next one
-    devindex+=1;
-   }
-  while(devindex<NumDevices);
+void HW_Combine(HW_DEVICE *Device, BYTE Token, BYTE *DataMessage)
+ {
+  BYTE pin = DataMessage[0];
 
-  // If we have exhausted the devices, then our device is not found, so return failure  
-  return(ErrorMessage("BackHauler PMOD was not found", "Device Not Found"));
+  if((Device->CombineDriveSet | Device->CombineStateSet) == 0) Device->CombineStart = GetTickCount();
+  if(Token == TOKEN_COMMAND_PMOD_SET_PIN_DRIVE)
+   {
+    Device->CombineDrive[pin] = DataMessage[1];
+    Device->CombineDriveSet |= 1 << pin;
+   }
+  else
+   {
+    Device->CombineState[pin] = DataMessage[1];
+    Device->CombineStateSet |= 1 << pin;
+   };
  } 
 
 /*--------------------------------------------------------------------------*/
 
-/* HW_CLOSE closes the device to which the handle was opened.
+/* HW_COMBINEWAIT returns the time in mS until held pin writes fall due, 0 if
+   they are already due, or INFINITE if nothing is held.
+*/
+
+DWORD HW_CombineWait(HW_DEVICE *Device)
+ {
+  DWORD elapsed;
+
+  if((Device->CombineDriveSet | Device->CombineStateSet) == 0) return(INFINITE);
+  elapsed = GetTickCount() - Device->CombineStart;
+  return((elapsed < HW_COMBINE_DELAY) ? HW_COMBINE_DELAY - elapsed : 0);
+ } 
+
+/*--------------------------------------------------------------------------*/
 
+/* HW_FLUSHCOMBINED sends the pin writes held for combining as posted 
+   writes, one for each pin whose state or drive differs from what was last
+   sent to it.  States go before drives, so that a pin made push-pull comes
+   up at its new state.  A failure is held as for any posted write.
 */
 
-DWORD HW_Close(void)
+void HW_FlushCombined(HW_DEVICE *Device)
  {
-  // MessageBox(NULL, "HW_Close", "", MB_TASKMODAL);
+  HW_REQUEST request = { TOKEN_RESPONSE_STATUS, HW_RESPONSE_STATUS, 0, NULL, NULL, NULL, 1 };
+  WORD bit;
+  BYTE pin, buf[2];
 
-  if(hBHPMOD == INVALID_HANDLE_VALUE) return(1);
-  SI_Close(hBHPMOD);
-  hBHPMOD = INVALID_HANDLE_VALUE;
-  return(1);
+  // Check there is something held
+  if((Device->CombineDriveSet | Device->CombineStateSet) == 0) return;
+
+  // Send the states, then the drives, skipping those that would change nothing
+  for(pin=0;pin<=HW_MAX_SHADOW_PIN;pin++)
+   {
+    bit = 1 << pin;
+    if(!(Device->CombineStateSet & bit)) continue;
+    if((Device->ShadowStateSet & bit) && ((Device->ShadowState[pin] != 0) == (Device->CombineState[pin] != 0))) continue;
+    buf[0] = pin;
+    buf[1] = Device->CombineState[pin];
+    HW_PostCommand(Device, TOKEN_COMMAND_PMOD_WRITE_PIN, 2, buf, &request);
+   };
+  for(pin=0;pin<=HW_MAX_SHADOW_PIN;pin++)
+   {
+    bit = 1 << pin;
+    if(!(Device->CombineDriveSet & bit)) continue;
+    if((Device->ShadowDriveSet & bit) && ((Device->ShadowDrive[pin] != 0) == (Device->CombineDrive[pin] != 0))) continue;
+    buf[0] = pin;
+    buf[1] = Device->CombineDrive[pin];
+    HW_PostCommand(Device, TOKEN_COMMAND_PMOD_SET_PIN_DRIVE, 2, buf, &request);
+   };
+
+  // Nothing is held now
+  Device->CombineStateSet = 0;
+  Device->CombineDriveSet = 0;
  } 
 
 /*--------------------------------------------------------------------------*/
+/* General Purpose And Helper Subroutines                                   */
+/*--------------------------------------------------------------------------*/
 
-/* HW_SENDDEVICECOMMAND sends the specified command and data to the device 
-   over the USB driver infrastructure.  A 1/0 pass/fail response is returned.
+/* COMPLETEREQUEST interprets a response according to the record made when 
+   its command was sent and returns the results to the caller arguments.  
+   The 1/0 result is what the exported function returns for the command.
+   By the ICD, a normal command failure would return status with the error 
+   bit set.  Any other unexpected token would be an even more severe failure.
+   All failures mean no data and failure response.
 */
 
-DWORD HW_SendDeviceCommand(BYTE Token, BYTE Count, void *DataMessage)
+DWORD CompleteRequest(HW_REQUEST *Request, BYTE Token, BYTE Count, BYTE *DataMessage)
  {
-  SI_STATUS status;
-  BYTE packet[64];
-  DWORD WrCnt;
+  BYTE cnt;
 
-  // MessageBox(NULL, "HW_SendDeviceCommand", "", MB_TASKMODAL);
+  // If the token is something other than expected, that is a failure
+  if(Token != Request->ResponseToken) 
+   {
+    if(Request->ResponseToken == TOKEN_RESPONSE_STATUS)
+     ErrorMessage(BHPMOD_ERROR_RESPONSE, "Unexpected device response in place of status", "Device Communication Error");
+    return(FailRequest(Request));
+   };
 
-  // Check device
-  if(hBHPMOD == INVALID_HANDLE_VALUE) return(0);  
+  // Return the results as appropriate for the kind of response
+  switch(Request->Kind)
+   {
+    case HW_RESPONSE_STATUS:
+     // Success depends on the error bit
+     if(Count < 1) return(FailRequest(Request));
+     return((DataMessage[0] & STATUS_BIT_ERROR) ? ErrorCommandFailed() : 1);
+
+    case HW_RESPONSE_STATUS_VALUE:
+     // The status itself is returned
+     if(Count < 1) return(FailRequest(Request));
+     *(BYTE *)Request->Content = DataMessage[0];
+     return(1);
+
+    case HW_RESPONSE_VALUE:
+     // A fixed size value is returned
+     if(Count != Request->Limit) return(FailRequest(Request));
+     memcpy(Request->Content, DataMessage, Count);
+     return(1);
+
+    case HW_RESPONSE_DATA:
+     // Data are returned up to the limit along with the count
+     cnt = (Count < Request->Limit) ? Count : Request->Limit;
+     if(cnt > 0) memcpy(Request->Content, DataMessage, cnt);
+     *Request->Count = cnt;
+     return(1);
+
+    case HW_RESPONSE_COUNT:
+     // Only the count is returned
+     if(Request->Count != NULL) *Request->Count = Count;
+     return(1);
+
+    case HW_RESPONSE_I2C_WRITE:
+     // The count actually written is in the message
+     if(Count < 5) return(FailRequest(Request));
+     *Request->Count = DataMessage[4];
+     return(1);
+
+    case HW_RESPONSE_I2C_READ:
+     // The count actually read is in the message followed by the data
+     if(Count < 5) return(FailRequest(Request));
+     cnt = DataMessage[4];
+     if(cnt > Count - 5) cnt = Count - 5;
+     if(cnt > Request->Limit) cnt = Request->Limit;
+     *Request->Count = cnt;
+     if(cnt > 0) memcpy(Request->Content, &DataMessage[5], cnt);
+     return(1);
+   };
 
-  // Check arguments
-  if(Count > 62) return(0);
-  if((Count > 0) && (DataMessage == NULL)) return(0);
+  // Anything else is not understood
+  return(FailRequest(Request));
+ } 
 
-  // Construct packet
-  packet[0] = Token;
-  packet[1] = Count;
-  memcpy(&packet[2], DataMessage, Count);
+/*--------------------------------------------------------------------------*/
 
-  // Send packet
-  status = SI_Write(hBHPMOD, packet, Count+2, &WrCnt); 
-  if(status != SI_SUCCESS) return(0);
+/* FAILREQUEST returns a failed request to the caller by clearing any count
+   returned by reference.  A zero is returned for convenience.  
+*/
 
-  // Return success
-  return(1);
+DWORD FailRequest(HW_REQUEST *Request)
+ {
+  if(Request->Count != NULL) *Request->Count = 0;
+  return(0);
  } 
 
 /*--------------------------------------------------------------------------*/
 
-/* HW_GETDEVICERESPONSE attempts to receive an ordinary command response.  
-   The token and count will be read, followed by the message contents.  
-   If the read was successful within the default timeout, then a 1 is 
-   returned, otherwise a zero is returned.  The data are returned by 
-   reference.  Up to 62 bytes can be returned in the data message; but 
-   for convenience in passing variables of arbitrary type, the routine
-   will not return more data than the count in the argument on entry.
-   However, the count will be updated on exit to reflect the number of 
-   bytes actually provided in the response packet.  This can help the
-   caller interpret an unexpected response.  Less data can be returned
-   than in the count on entry.  The full response is always cleared from 
-   the USB pipe by this routine.
-*/ 
+/* LISTOPERATIONSIZE returns the number of bytes taken by the operation at 
+   the start of an operation list, and gives the number of result bytes it
+   produces by reference, both as the ICD defines.  A zero is returned if 
+   the operation is not known or does not fit in the bytes remaining.  This
+   must agree with the embedded code, which checks every list the same way.
+*/
 
-DWORD HW_GetDeviceResponse(BYTE *Token, BYTE *Count, void *DataMessage)
+BYTE ListOperationSize(BYTE Remaining, BYTE *Operation, BYTE *ResultSize)
  {
-  SI_STATUS status;
-  BYTE packet[64];
-  DWORD RdCnt;
-  BYTE limit_count = *Count;
+  switch(Operation[0])
+   {
+    case LIST_OP_SPI:
+     if((Remaining < 2) || (Operation[1] > Remaining - 2)) return(0);
+     *ResultSize = 1 + Operation[1];
+     return(2 + Operation[1]);
+
+    case LIST_OP_I2C_WRITE:
+     if((Remaining < 6) || (Operation[5] > Remaining - 6)) return(0);
+     *ResultSize = 1;
+     return(6 + Operation[5]);
+
+    case LIST_OP_I2C_READ:
+     if((Remaining < 6) || (Operation[5] > 61)) return(0);
+     *ResultSize = 1 + Operation[5];
+     return(6);
+
+    case LIST_OP_WRITE_PIN:
+     if(Remaining < 3) return(0);
+     *ResultSize = 0;
+     return(3);
+
+    case LIST_OP_READ_PIN:
+     if(Remaining < 2) return(0);
+     *ResultSize = 1;
+     return(2);
+
+    case LIST_OP_DELAY:
+     if(Remaining < 2) return(0);
+     *ResultSize = 0;
+     return(2);
+   };
 
-  // MessageBox(NULL, "HW_GetDeviceResponse", "", MB_TASKMODAL);
+  // Not known
+  return(0);
+ } 
 
-  // Check device
-  if(hBHPMOD == INVALID_HANDLE_VALUE) return(0);  
+/*--------------------------------------------------------------------------*/
 
-  // Check arguments
-  if(Token == NULL) return(0);
-  if(Count == NULL) return(0);
-  if((*Count > 0) && (DataMessage == NULL)) return(0);
+/* TESTCODE does the work of BHPMOD_TestCode on the executor thread.  The
+   context is an array of the test number and the two argument values, and
+   the argument values are updated in place.
+*/
 
-  // Attempt to collect an input packet token and count
-  status = SI_Read(hBHPMOD, packet, 2, &RdCnt);
-  if(status != SI_SUCCESS) return(0);
-  *Token = packet[0];
-  *Count = packet[1];
-  // Attempt to collect the input data portion
-  if(*Count > 0) 
+DWORD TestCode(HW_DEVICE *Device, void *Context)
+ {
+  DWORD *args = (DWORD *)Context;
+  DWORD Arg1 = args[1];
+  DWORD Arg2 = args[2];
+  BYTE TestNumber = (BYTE)args[0];
+  BYTE test_packet[100];
+  BYTE token = 0;
+  BYTE count = 0;
+  LARGE_INTEGER frequency, start, stop;
+  LONGLONG total, worst;
+  DWORD i;
+
+  // Test traffic is raw, so nothing else may be in flight
+  HW_CollectAll(Device);
+
+  // Load the test number in the first data byte - embedded test code would use this
+  test_packet[0] = TestNumber;
+  
+  // Do the prescribed test
+  switch(TestNumber)
    {
-    status = SI_Read(hBHPMOD, packet, *Count, &RdCnt);
-    if(status != SI_SUCCESS) return(0);
-    if(*Count < limit_count) limit_count = *Count;
-    memcpy(DataMessage, packet, limit_count);
+    case 0: 
+     break;
+
+    case 1:
+     // Command latency - time Arg1 status commands, 1000 if 0, each waiting for its response
+     // The average round trip is returned in Arg1 and the longest in Arg2, both in uS
+     if(Arg1 == 0) Arg1 = 1000;
+     QueryPerformanceFrequency(&frequency);
+     total = 0;
+     worst = 0;
+     for(i = 0; i < Arg1; i++)
+      {
+       QueryPerformanceCounter(&start);
+       if(!HW_Exchange(Device, TOKEN_COMMAND_GET_STATUS, 0, NULL)) break;
+       QueryPerformanceCounter(&stop);
+       total += stop.QuadPart - start.QuadPart;
+       if(stop.QuadPart - start.QuadPart > worst) worst = stop.QuadPart - start.QuadPart;
+      };
+     if(i < Arg1)
+      {
+       Arg1 = 0xBAD00001;
+       Arg2 = 0xBAD00002;
+       break;
+      };
+     Arg1 = (DWORD)(total * 1000000 / frequency.QuadPart / i);
+     Arg2 = (DWORD)(worst * 1000000 / frequency.QuadPart);
+     break;
+
+    case 2:
+     break;
+
+    case 90:
+     // Poke xdata
+     test_packet[1] = HIBYTE(LOWORD(Arg1));
+     test_packet[2] = LOBYTE(LOWORD(Arg1));
+     test_packet[3] = LOBYTE(LOWORD(Arg2));
+     HW_SendDeviceCommand(Device, TOKEN_COMMAND_TEST, 4, test_packet, 0, 0);
+     Arg2 = test_packet[3];
+     break;
+
+    case 91:
+     // Peek xdata
+     test_packet[1] = HIBYTE(LOWORD(Arg1));
+     test_packet[2] = LOBYTE(LOWORD(Arg1));
+     HW_SendDeviceCommand(Device, TOKEN_COMMAND_TEST, 3, test_packet, 0, 0);
+     count = 1;
+     HW_GetDeviceResponse(Device, &token, &count, test_packet);
+     Arg2 = test_packet[0];
+     break;
+
+    case 99:
+     // Change test mode
+     test_packet[1] = LOBYTE(LOWORD(Arg1));
+     HW_SendDeviceCommand(Device, TOKEN_COMMAND_TEST, 2, test_packet, 0, 0);
+     break;
+
+    default:
+     Arg1 = 0xBAD00001;
+     Arg2 = 0xBAD00002;
+     break;
    };
 
-  // Return success
+  // Return the updated arguments
+  args[1] = Arg1;
+  args[2] = Arg2;
   return(1);
  } 
 
 /*--------------------------------------------------------------------------*/
-/* General Purpose And Helper Subroutines                                   */
+
+/* HW_THREADERROR returns the last error record of the calling thread, 
+   creating it the first time.  NULL is returned if it cannot be created.
+   The record is freed when the thread exits.
+*/
+
+HW_ERROR *HW_ThreadError(void)
+ {
+  HW_ERROR *error = (HW_ERROR *)TlsGetValue(ThreadErrorIndex);
+
+  if(error != NULL) return(error);
+  error = (HW_ERROR *)calloc(1, sizeof(HW_ERROR));
+  if(error == NULL) return(NULL);
+  TlsSetValue(ThreadErrorIndex, error);
+  return(error);
+ } 
+
 /*--------------------------------------------------------------------------*/
 
-/* GETSTATUSRESPONSE collects a status response from the device.  This will 
-   generally wait up to the default timeout for a response to return, thus
-   allowing a brief wait for completion.  If anything other than a status 
-   is returned, a message is displayed.  The status byte is returned
-   by reference.
+/* HW_SETERROR fills in an error record, cutting the detail short if it does 
+   not fit.  A NULL detail leaves it empty.
 */
 
-DWORD GetStatusResponse(BYTE *Status)
+void HW_SetError(HW_ERROR *Error, DWORD Code, char *Detail)
  {
-  BYTE token, count, val;
+  Error->Code = Code;
+  Error->Detail[0] = 0;
+  if(Detail != NULL) strncat(Error->Detail, Detail, BHPMOD_MAX_ERROR_LENGTH - 1);
+ } 
+
+/*--------------------------------------------------------------------------*/
 
-  // Get the response 
-  count = 1;
-  if(!HW_GetDeviceResponse(&token, &count, &val)) return(ErrorInternal());
+/* HW_CLEARERROR clears the last error of the calling thread, so that a 
+   failure can tell whether something was recorded for it.
+*/
 
-  // Make sure the response is a status
-  if(token != TOKEN_RESPONSE_STATUS) 
-   {
-    MessageBox(NULL, "Unexpected device response in place of status", "Device Communication Error", MB_ICONSTOP | MB_TASKMODAL);
-    return(0);
-   };
+void HW_ClearError(void)
+ {
+  HW_ERROR *error = HW_ThreadError();
 
-  // Return the status
-  *Status = val;
-  
-  // Return success 
-  return(1);
+  if(error != NULL) HW_SetError(error, BHPMOD_ERROR_NONE, NULL);
  } 
 
 /*--------------------------------------------------------------------------*/
 
-/* ERRORMESSAGE notifies the user of an error specified by a text string.  
-   A zero is returned for convenience.  
+/* ERRORMESSAGE records an error specified by a code and a text string.  It
+   becomes the last error of the calling thread and is written to the error
+   log, then the application callback is made if there is one.  The user is
+   only shown a dialog if dialogs have been enabled, since a modal dialog 
+   would stall the thread that found the error, which may be an executor 
+   thread with other threads waiting on it.  A zero is returned for 
+   convenience.  
 */
 
-DWORD ErrorMessage(char *ErrorDescription, char *ErrorType) 
+DWORD ErrorMessage(DWORD Code, char *ErrorDescription, char *ErrorType) 
  {
-  MessageBox(NULL, ErrorDescription, ErrorType, MB_ICONSTOP | MB_TASKMODAL);
+  HW_ERROR *error = HW_ThreadError();
+  HW_ERROR_ENTRY *entry;
+  BHPMOD_ERROR_CALLBACK callback = ErrorCallback;
+  LONG sequence;
+
+  // Make it the last error of this thread
+  if(error != NULL) HW_SetError(error, Code, ErrorDescription);
+
+  // Claim the next entry in the log and write it
+  sequence = InterlockedIncrement(&ErrorLogSequence);
+  entry = &ErrorLog[(DWORD)sequence % HW_ERROR_LOG_SIZE];
+  InterlockedExchange(&entry->Sequence, 0);
+  HW_SetError(&entry->Error, Code, ErrorDescription);
+  InterlockedExchange(&entry->Sequence, sequence);
+
+  // Tell the application
+  if(callback != NULL) callback(Code, ErrorDescription, ErrorCallbackContext);
+  if(ErrorDialogs) MessageBox(NULL, ErrorDescription, ErrorType, MB_ICONSTOP | MB_TASKMODAL);
   return(0);
  } 
 
@@ -14,11 +14,89 @@
 /* API Data Definitions                                                      */
 /*---------------------------------------------------------------------------*/
 
+// Handle to an open device as returned by BHPMOD_Open
+// The functions without a handle use the first device found when one of them is first used
+typedef struct BHPMOD_DEVICE *BHPMOD_HANDLE;
+
+// Size of a buffer that can hold any serial number string
+#define BHPMOD_MAX_SERIAL_LENGTH  256
+
+// Offsets of the values in a snapshot from BHPMOD_GetPort, and its size
+// The pin states and drives are one bit per pin per the PMOD_PORT_PINn definitions in the ICD
+#define BHPMOD_PORT_STATUS        0   /* Status as from BHPMOD_GetStatus */
+#define BHPMOD_PORT_CONFIGURATION 1   /* Present configuration */
+#define BHPMOD_PORT_STATES        2   /* State of every pin */
+#define BHPMOD_PORT_DRIVES        3   /* Drive configuration of every pin, 1 for push-pull */
+#define BHPMOD_PORT_SIZE          4
+
+// Size of the hardware version text in BHPMOD_CAPABILITIES, with its terminating null
+#define BHPMOD_MAX_VERSION_LENGTH 48
+
+// Capabilities of a device as returned by BHPMOD_GetCapabilities
+// Features are the CAPABILITY_BIT values of the ICD, and the rates and sizes are 0 if not reported
+typedef struct
+ {
+  DWORD FirmwareVersion;                      // Firmware version code, 0x20 for version 2.0
+  DWORD Features;                             // Optional commands the firmware has
+  DWORD CommandsHeld;                         // Commands the device takes before answering the first
+  DWORD MaxSpiRate;                           // Fastest SPI clock in Hz
+  DWORD MaxI2cRate;                           // Fastest I2C clock in Hz
+  DWORD MaxI2cBulkPage;                       // Largest I2C bulk write page in bytes
+  DWORD SerialBufferSpace;                    // Bytes shared by the serial buffers
+  char HardwareVersion[BHPMOD_MAX_VERSION_LENGTH]; // Hardware version text, empty if not reported
+ } BHPMOD_CAPABILITIES;
+
+// Completion callback for the asynchronous functions
+// Called once with the 1/0 result the waiting function would have returned
+typedef void (WINAPI *BHPMOD_CALLBACK)(BHPMOD_HANDLE Device, DWORD Result, void *Context);
+
+// Largest sample an acquisition job can give
+#define BHPMOD_MAX_SAMPLE_SIZE    55
+
+// Sample pushed by the device as kept for BHPMOD_STREAM_Peek
+typedef struct
+ {
+  DWORD Timestamp;                            // Time the sample was taken in mS from the start of the job
+  BYTE Size;                                  // Bytes in the sample
+  BYTE Content[BHPMOD_MAX_SAMPLE_SIZE];       // Results of the job's operation list
+ } BHPMOD_SAMPLE;
+
+// Serial receive callback for BHPMOD_SERIAL_SetEvents
+// Called with the bytes pushed by the device, which are only valid during the call
+typedef void (WINAPI *BHPMOD_SERIAL_CALLBACK)(BHPMOD_HANDLE Device, DWORD Count, BYTE *Content, void *Context);
+
+// Error codes as returned by BHPMOD_GetLastError and BHPMOD_ReadErrorLog
+#define BHPMOD_ERROR_NONE         0   /* No error recorded */
+#define BHPMOD_ERROR_PARAMETER    1   /* An argument was not valid */
+#define BHPMOD_ERROR_NOT_FOUND    2   /* The device is not attached */
+#define BHPMOD_ERROR_DRIVER       3   /* The USB driver reported an error */
+#define BHPMOD_ERROR_RESOURCE     4   /* Memory or a thread could not be had */
+#define BHPMOD_ERROR_NO_RESPONSE  5   /* The device did not respond in time */
+#define BHPMOD_ERROR_RESPONSE     6   /* The device response did not fit the command */
+#define BHPMOD_ERROR_DEVICE       7   /* The device reported that the command failed */
+#define BHPMOD_ERROR_FILE         8   /* A file could not be read or is not valid */
+#define BHPMOD_ERROR_ORDER        9   /* Functions were called out of order */
+#define BHPMOD_ERROR_TIMEOUT      10  /* An attached part stayed busy too long */
+#define BHPMOD_ERROR_POSTED       11  /* An earlier posted write failed */
+
+// Size of a buffer that can hold any error detail string
+#define BHPMOD_MAX_ERROR_LENGTH   128
+
+// Error callback, made on whichever thread found the error
+typedef void (WINAPI *BHPMOD_ERROR_CALLBACK)(DWORD Code, char *Detail, void *Context);
 
 /*---------------------------------------------------------------------------*/
 /* API Exports                                                               */
 /*---------------------------------------------------------------------------*/
 
+// Device functions - find and open devices for use with the functions taking a handle
+DCAPI BHPMOD_Enumerate(DWORD *NumDevices);
+DCAPI BHPMOD_GetSerialNumber(DWORD DeviceIndex, char *SerialNumber);
+DCAPI BHPMOD_Open(char *SerialNumber, BHPMOD_HANDLE *Device);
+DCAPI BHPMOD_Close(BHPMOD_HANDLE Device);
+DCAPI BHPMOD_SetSerialNumber(BHPMOD_HANDLE Device, char *SerialNumber);
+DCAPI BHPMOD_GetCapabilities(BHPMOD_HANDLE Device, BHPMOD_CAPABILITIES *Capabilities);
+
 // General utility functions - always valid
 DCAPI BHPMOD_GetStatus(BYTE *Status);
 DCAPI BHPMOD_SetConfiguration(BYTE Configuration);
@@ -27,19 +105,121 @@ DCAPI BHPMOD_SetConfiguration(BYTE Configuration);
 DCAPI BHPMOD_SetPinDrive(BYTE PinNumber, BYTE PushPull);
 DCAPI BHPMOD_SetPinState(BYTE PinNumber, BYTE State);
 DCAPI BHPMOD_GetPinState(BYTE PinNumber, BYTE *State);
+DCAPI BHPMOD_SetPort(BYTE StateMask, BYTE States, BYTE DriveMask, BYTE Drives);
+DCAPI BHPMOD_GetPort(BYTE *Snapshot);
 
 // SPI functions - valid in SPI configuration 
 DCAPI BHPMOD_SPI_SetClockPhase(BYTE ClockPhase);
+DCAPI BHPMOD_SPI_SetClockRate(DWORD Rate);
+DCAPI BHPMOD_SPI_SetTiming(BYTE SetupTime, BYTE HoldTime);
 DCAPI BHPMOD_SPI_Transaction(BYTE *Count, BYTE *Buffer);
+DCAPI BHPMOD_SPI_BulkTransaction(DWORD Count, BYTE *WriteContent, BYTE *ReadContent);
 
 // I2C functions - valid in I2C configuration
+DCAPI BHPMOD_I2C_SetClockRate(DWORD Rate);
+DCAPI BHPMOD_I2C_SetTimeout(WORD Milliseconds);
 DCAPI BHPMOD_I2C_Write(BYTE Address, BYTE SubAddrSize, void *SubAddr, BYTE *Count, void *Content);
 DCAPI BHPMOD_I2C_Read(BYTE Address, BYTE SubAddrSize, void *SubAddr, BYTE *Count, void *Content);
+DCAPI BHPMOD_I2C_BulkWrite(BYTE Address, BYTE SubAddrSize, void *SubAddr, WORD PageSize, DWORD Count, void *Content);
+DCAPI BHPMOD_I2C_BulkRead(BYTE Address, BYTE SubAddrSize, void *SubAddr, DWORD Count, void *Content);
 
 // SERIAL functions - valid in SERIAL configuration
+DCAPI BHPMOD_SERIAL_SetLine(DWORD BaudRate, BYTE Format);
+DCAPI BHPMOD_SERIAL_SetBuffers(WORD TxDepth, WORD RxDepth);
 DCAPI BHPMOD_SERIAL_Print(char *Strz);
+DCAPI BHPMOD_SERIAL_Stream(DWORD Count, BYTE *Content);
 DCAPI BHPMOD_SERIAL_Write(BYTE *Count, BYTE *Content);
 DCAPI BHPMOD_SERIAL_Read(BYTE *Count, BYTE *Content);
+DCAPI BHPMOD_SERIAL_SetEvents(BYTE Threshold, WORD IdleTime, BHPMOD_SERIAL_CALLBACK Callback, void *Context);
+DCAPI BHPMOD_SERIAL_WaitRead(DWORD *Count, BYTE *Content, DWORD Timeout);
+
+// Operation list functions - run several operations on the device in one round trip
+DCAPI BHPMOD_RunList(BYTE Count, BYTE *List, BYTE *ResultCount, BYTE *Results);
+
+// Acquisition functions - have the device run an operation list every period and keep the samples
+DCAPI BHPMOD_ACQ_Start(WORD Period, BYTE Count, BYTE *List);
+DCAPI BHPMOD_ACQ_Stop(void);
+DCAPI BHPMOD_ACQ_Read(DWORD *Count, DWORD *Timestamps, BYTE *Samples, DWORD *Lost);
+
+// Streaming functions - have the device push the acquisition samples and take them in place
+DCAPI BHPMOD_STREAM_Start(BYTE Threshold, WORD Latency, DWORD Depth);
+DCAPI BHPMOD_STREAM_Stop(void);
+DCAPI BHPMOD_STREAM_Peek(BHPMOD_SAMPLE **Samples, DWORD *Count, DWORD Timeout);
+DCAPI BHPMOD_STREAM_Release(DWORD Count);
+DCAPI BHPMOD_STREAM_GetCounters(DWORD *DeviceLost, DWORD *Missed, DWORD *HostLost);
+
+// Pipeline functions - post commands without waiting and collect responses in order
+DCAPI BHPMOD_PIPELINE_Begin(BYTE Window);
+DCAPI BHPMOD_PIPELINE_Collect(DWORD *Outstanding);
+DCAPI BHPMOD_PIPELINE_End(DWORD *Failures);
+DCAPI BHPMOD_SetSequencing(BYTE Enable);
+
+// Posted and combined write functions - writes return without waiting, failures reported later
+DCAPI BHPMOD_SetPostedWrites(BYTE Enable);
+DCAPI BHPMOD_Fence(void);
+DCAPI BHPMOD_SetWriteCombining(BYTE Enable);
+DCAPI BHPMOD_Flush(void);
+
+// Functions taking a handle - the same as those above for any open device
+DCAPI BHPMOD_GetStatusEx(BHPMOD_HANDLE Device, BYTE *Status);
+DCAPI BHPMOD_SetConfigurationEx(BHPMOD_HANDLE Device, BYTE Configuration);
+DCAPI BHPMOD_SetPinDriveEx(BHPMOD_HANDLE Device, BYTE PinNumber, BYTE PushPull);
+DCAPI BHPMOD_SetPinStateEx(BHPMOD_HANDLE Device, BYTE PinNumber, BYTE State);
+DCAPI BHPMOD_GetPinStateEx(BHPMOD_HANDLE Device, BYTE PinNumber, BYTE *State);
+DCAPI BHPMOD_SetPortEx(BHPMOD_HANDLE Device, BYTE StateMask, BYTE States, BYTE DriveMask, BYTE Drives);
+DCAPI BHPMOD_GetPortEx(BHPMOD_HANDLE Device, BYTE *Snapshot);
+DCAPI BHPMOD_SPI_SetClockPhaseEx(BHPMOD_HANDLE Device, BYTE ClockPhase);
+DCAPI BHPMOD_SPI_SetClockRateEx(BHPMOD_HANDLE Device, DWORD Rate);
+DCAPI BHPMOD_SPI_SetTimingEx(BHPMOD_HANDLE Device, BYTE SetupTime, BYTE HoldTime);
+DCAPI BHPMOD_SPI_TransactionEx(BHPMOD_HANDLE Device, BYTE *Count, BYTE *Buffer);
+DCAPI BHPMOD_SPI_BulkTransactionEx(BHPMOD_HANDLE Device, DWORD Count, BYTE *WriteContent, BYTE *ReadContent);
+DCAPI BHPMOD_I2C_SetClockRateEx(BHPMOD_HANDLE Device, DWORD Rate);
+DCAPI BHPMOD_I2C_SetTimeoutEx(BHPMOD_HANDLE Device, WORD Milliseconds);
+DCAPI BHPMOD_I2C_WriteEx(BHPMOD_HANDLE Device, BYTE Address, BYTE SubAddrSize, void *SubAddr, BYTE *Count, void *Content);
+DCAPI BHPMOD_I2C_ReadEx(BHPMOD_HANDLE Device, BYTE Address, BYTE SubAddrSize, void *SubAddr, BYTE *Count, void *Content);
+DCAPI BHPMOD_I2C_BulkWriteEx(BHPMOD_HANDLE Device, BYTE Address, BYTE SubAddrSize, void *SubAddr, WORD PageSize, DWORD Count, void *Content);
+DCAPI BHPMOD_I2C_BulkReadEx(BHPMOD_HANDLE Device, BYTE Address, BYTE SubAddrSize, void *SubAddr, DWORD Count, void *Content);
+DCAPI BHPMOD_SERIAL_SetLineEx(BHPMOD_HANDLE Device, DWORD BaudRate, BYTE Format);
+DCAPI BHPMOD_SERIAL_SetBuffersEx(BHPMOD_HANDLE Device, WORD TxDepth, WORD RxDepth);
+DCAPI BHPMOD_SERIAL_PrintEx(BHPMOD_HANDLE Device, char *Strz);
+DCAPI BHPMOD_SERIAL_StreamEx(BHPMOD_HANDLE Device, DWORD Count, BYTE *Content);
+DCAPI BHPMOD_SERIAL_WriteEx(BHPMOD_HANDLE Device, BYTE *Count, BYTE *Content);
+DCAPI BHPMOD_SERIAL_ReadEx(BHPMOD_HANDLE Device, BYTE *Count, BYTE *Content);
+DCAPI BHPMOD_SERIAL_SetEventsEx(BHPMOD_HANDLE Device, BYTE Threshold, WORD IdleTime, BHPMOD_SERIAL_CALLBACK Callback, void *Context);
+DCAPI BHPMOD_SERIAL_WaitReadEx(BHPMOD_HANDLE Device, DWORD *Count, BYTE *Content, DWORD Timeout);
+DCAPI BHPMOD_RunListEx(BHPMOD_HANDLE Device, BYTE Count, BYTE *List, BYTE *ResultCount, BYTE *Results);
+DCAPI BHPMOD_ACQ_StartEx(BHPMOD_HANDLE Device, WORD Period, BYTE Count, BYTE *List);
+DCAPI BHPMOD_ACQ_StopEx(BHPMOD_HANDLE Device);
+DCAPI BHPMOD_ACQ_ReadEx(BHPMOD_HANDLE Device, DWORD *Count, DWORD *Timestamps, BYTE *Samples, DWORD *Lost);
+DCAPI BHPMOD_STREAM_StartEx(BHPMOD_HANDLE Device, BYTE Threshold, WORD Latency, DWORD Depth);
+DCAPI BHPMOD_STREAM_StopEx(BHPMOD_HANDLE Device);
+DCAPI BHPMOD_STREAM_PeekEx(BHPMOD_HANDLE Device, BHPMOD_SAMPLE **Samples, DWORD *Count, DWORD Timeout);
+DCAPI BHPMOD_STREAM_ReleaseEx(BHPMOD_HANDLE Device, DWORD Count);
+DCAPI BHPMOD_STREAM_GetCountersEx(BHPMOD_HANDLE Device, DWORD *DeviceLost, DWORD *Missed, DWORD *HostLost);
+DCAPI BHPMOD_PIPELINE_BeginEx(BHPMOD_HANDLE Device, BYTE Window);
+DCAPI BHPMOD_PIPELINE_CollectEx(BHPMOD_HANDLE Device, DWORD *Outstanding);
+DCAPI BHPMOD_PIPELINE_EndEx(BHPMOD_HANDLE Device, DWORD *Failures);
+DCAPI BHPMOD_SetSequencingEx(BHPMOD_HANDLE Device, BYTE Enable);
+DCAPI BHPMOD_SetPostedWritesEx(BHPMOD_HANDLE Device, BYTE Enable);
+DCAPI BHPMOD_FenceEx(BHPMOD_HANDLE Device);
+DCAPI BHPMOD_SetWriteCombiningEx(BHPMOD_HANDLE Device, BYTE Enable);
+DCAPI BHPMOD_FlushEx(BHPMOD_HANDLE Device);
+
+// Asynchronous functions - queue the command and call back when it has finished
+DCAPI BHPMOD_SetPinStateAsync(BHPMOD_HANDLE Device, BYTE PinNumber, BYTE State, BHPMOD_CALLBACK Callback, void *Context);
+DCAPI BHPMOD_GetPinStateAsync(BHPMOD_HANDLE Device, BYTE PinNumber, BYTE *State, BHPMOD_CALLBACK Callback, void *Context);
+DCAPI BHPMOD_SPI_TransactionAsync(BHPMOD_HANDLE Device, BYTE *Count, BYTE *Buffer, BHPMOD_CALLBACK Callback, void *Context);
+DCAPI BHPMOD_I2C_WriteAsync(BHPMOD_HANDLE Device, BYTE Address, BYTE SubAddrSize, void *SubAddr, BYTE *Count, void *Content, BHPMOD_CALLBACK Callback, void *Context);
+DCAPI BHPMOD_I2C_ReadAsync(BHPMOD_HANDLE Device, BYTE Address, BYTE SubAddrSize, void *SubAddr, BYTE *Count, void *Content, BHPMOD_CALLBACK Callback, void *Context);
+DCAPI BHPMOD_SERIAL_WriteAsync(BHPMOD_HANDLE Device, BYTE *Count, BYTE *Content, BHPMOD_CALLBACK Callback, void *Context);
+DCAPI BHPMOD_SERIAL_ReadAsync(BHPMOD_HANDLE Device, BYTE *Count, BYTE *Content, BHPMOD_CALLBACK Callback, void *Context);
+
+// Error functions - find out why a function failed
+DCAPI BHPMOD_GetLastError(DWORD *Code, char *Detail, DWORD Size);
+DCAPI BHPMOD_ReadErrorLog(DWORD *Sequence, DWORD *Code, char *Detail, DWORD Size);
+DCAPI BHPMOD_SetErrorCallback(BHPMOD_ERROR_CALLBACK Callback, void *Context);
+DCAPI BHPMOD_EnableDialogs(BYTE Enable);
+DCAPI BHPMOD_ReportError(DWORD Code, char *Detail, char *Caption);
 
 // Test and development functions - used only during intense embedded development
 DCAPI BHPMOD_TestCode(BYTE TestNumber, char *ArgStr1, char *ArgStr2);
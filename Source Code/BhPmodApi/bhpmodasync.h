@@ -0,0 +1,158 @@
+/* BHPMODASYNC.H
+
+   C++ helpers for the asynchronous functions of the Backhauler PMOD API.
+
+   Each helper queues the command and returns an operation that can either
+   be turned into a std::future or awaited in a C++20 coroutine.  The result
+   is the 1/0 result the waiting function would have returned, and as with
+   the asynchronous functions themselves, the arguments given must remain
+   valid until the operation has finished.
+
+     BYTE state;
+     std::future<DWORD> done = BHPMOD::GetPinState(Device, 3, &state).Future();
+     if(done.get()) ...
+
+     BYTE count = 4;
+     if(co_await BHPMOD::SPI_Transaction(Device, &count, buffer)) ...
+
+   A coroutine resumes on the thread that does all traffic with the device,
+   so it may await further operations but must not call a waiting function
+   for the same device before its next co_await.  Only this header is
+   needed, the DLL itself does not use it.
+*/
+
+#ifndef BHPMODASYNC_H
+#define BHPMODASYNC_H
+
+#include <windows.h>
+#include <future>
+#if defined(__cpp_impl_coroutine)
+#include <coroutine>
+#endif
+#include "bhpmodapi.h"
+
+namespace BHPMOD
+{
+
+/*---------------------------------------------------------------------------*/
+/* Operations                                                                */
+/*---------------------------------------------------------------------------*/
+
+/* An operation holds what starts one asynchronous function, given the
+   callback and context to use.  Nothing is queued until the operation is
+   turned into a future or awaited.
+*/
+template<typename Start> class Operation
+ {
+  public:
+   explicit Operation(Start start) : start_(start) {}
+
+   // Queue the function and return a future for its result
+   // A function that cannot be queued gives a result of 0 straight away
+   std::future<DWORD> Future()
+    {
+     std::promise<DWORD> *promise = new std::promise<DWORD>;
+     std::future<DWORD> future = promise->get_future();
+
+     if(!start_(Fulfil, promise))
+      {
+       promise->set_value(0);
+       delete promise;
+      };
+     return(future);
+    }
+
+#if defined(__cpp_impl_coroutine)
+   // Awaiting queues the function and resumes when the callback is made
+   // Nothing may be touched once queued, since the callback can come at once
+   bool await_ready() const noexcept { return(false); }
+   bool await_suspend(std::coroutine_handle<> handle)
+    {
+     handle_ = handle;
+     if(start_(Resume, this)) return(true);
+     result_ = 0;
+     return(false);
+    }
+   DWORD await_resume() const noexcept { return(result_); }
+#endif
+
+  private:
+   static void WINAPI Fulfil(BHPMOD_HANDLE, DWORD Result, void *Context)
+    {
+     std::promise<DWORD> *promise = (std::promise<DWORD> *)Context;
+
+     promise->set_value(Result);
+     delete promise;
+    }
+
+#if defined(__cpp_impl_coroutine)
+   static void WINAPI Resume(BHPMOD_HANDLE, DWORD Result, void *Context)
+    {
+     Operation *operation = (Operation *)Context;
+
+     operation->result_ = Result;
+     operation->handle_.resume();
+    }
+
+   std::coroutine_handle<> handle_;
+#endif
+   Start start_;
+   DWORD result_ = 0;
+ };
+
+template<typename Start> Operation<Start> MakeOperation(Start start)
+ {
+  return(Operation<Start>(start));
+ }
+
+/*---------------------------------------------------------------------------*/
+/* Asynchronous Device Functions                                             */
+/*---------------------------------------------------------------------------*/
+
+inline auto SetPinState(BHPMOD_HANDLE Device, BYTE PinNumber, BYTE State)
+ {
+  return(MakeOperation([=](BHPMOD_CALLBACK Callback, void *Context)
+   { return(BHPMOD_SetPinStateAsync(Device, PinNumber, State, Callback, Context)); }));
+ }
+
+inline auto GetPinState(BHPMOD_HANDLE Device, BYTE PinNumber, BYTE *State)
+ {
+  return(MakeOperation([=](BHPMOD_CALLBACK Callback, void *Context)
+   { return(BHPMOD_GetPinStateAsync(Device, PinNumber, State, Callback, Context)); }));
+ }
+
+inline auto SPI_Transaction(BHPMOD_HANDLE Device, BYTE *Count, BYTE *Buffer)
+ {
+  return(MakeOperation([=](BHPMOD_CALLBACK Callback, void *Context)
+   { return(BHPMOD_SPI_TransactionAsync(Device, Count, Buffer, Callback, Context)); }));
+ }
+
+inline auto I2C_Write(BHPMOD_HANDLE Device, BYTE Address, BYTE SubAddrSize, void *SubAddr, BYTE *Count, void *Content)
+ {
+  return(MakeOperation([=](BHPMOD_CALLBACK Callback, void *Context)
+   { return(BHPMOD_I2C_WriteAsync(Device, Address, SubAddrSize, SubAddr, Count, Content, Callback, Context)); }));
+ }
+
+inline auto I2C_Read(BHPMOD_HANDLE Device, BYTE Address, BYTE SubAddrSize, void *SubAddr, BYTE *Count, void *Content)
+ {
+  return(MakeOperation([=](BHPMOD_CALLBACK Callback, void *Context)
+   { return(BHPMOD_I2C_ReadAsync(Device, Address, SubAddrSize, SubAddr, Count, Content, Callback, Context)); }));
+ }
+
+inline auto SERIAL_Write(BHPMOD_HANDLE Device, BYTE *Count, BYTE *Content)
+ {
+  return(MakeOperation([=](BHPMOD_CALLBACK Callback, void *Context)
+   { return(BHPMOD_SERIAL_WriteAsync(Device, Count, Content, Callback, Context)); }));
+ }
+
+inline auto SERIAL_Read(BHPMOD_HANDLE Device, BYTE *Count, BYTE *Content)
+ {
+  return(MakeOperation([=](BHPMOD_CALLBACK Callback, void *Context)
+   { return(BHPMOD_SERIAL_ReadAsync(Device, Count, Content, Callback, Context)); }));
+ }
+
+} // namespace BHPMOD
+
+#endif
+
+/* End of header file */
@@ -31,18 +31,18 @@ char JEDEC_SeekNextKeyChar(void);
 BYTE JEDEC_ReadFuseByte(BYTE *FuseByte);
 
 /* General purpose subroutine declarations */
-DWORD ErrorMessage(char *ErrorDescription, char *ErrorType);
+DWORD ErrorMessage(DWORD Code, char *ErrorDescription, char *ErrorType);
 // Predefined error messages
-#define ErrorFileNotFound()         ErrorMessage("Unable to open the specified file", "File Error")
-#define ErrorFileFormat()           ErrorMessage("File format is not valid for JEDEC", "File Error")
-#define ErrorBadSetting()           ErrorMessage("JEDEC file has SPI slave port disabled - programming aborted", "File Error")
-#define ErrorBadValue()             ErrorMessage("Specified value is out of range", "Parameter Error")
-#define ErrorBadLength()            ErrorMessage("Requested length is not valid", "Parameter Error")
-#define ErrorBadAddress()           ErrorMessage("Bad offset or length given", "Parameter Error")
-#define ErrorNullPointer()          ErrorMessage("Data pointer provided is NULL", "Parameter Error")
-#define ErrorNotErased()            ErrorMessage("The FPGA must be erased to program", "Operation Order Error")
-#define ErrorNotOpen()              ErrorMessage("The SPI connection has not been initialized", "Operation Order Error")
-#define ErrorTimeout()              ErrorMessage("Timed out waiting for FPGA busy", "Timeout Error")
+#define ErrorFileNotFound()         ErrorMessage(BHPMOD_ERROR_FILE, "Unable to open the specified file", "File Error")
+#define ErrorFileFormat()           ErrorMessage(BHPMOD_ERROR_FILE, "File format is not valid for JEDEC", "File Error")
+#define ErrorBadSetting()           ErrorMessage(BHPMOD_ERROR_FILE, "JEDEC file has SPI slave port disabled - programming aborted", "File Error")
+#define ErrorBadValue()             ErrorMessage(BHPMOD_ERROR_PARAMETER, "Specified value is out of range", "Parameter Error")
+#define ErrorBadLength()            ErrorMessage(BHPMOD_ERROR_PARAMETER, "Requested length is not valid", "Parameter Error")
+#define ErrorBadAddress()           ErrorMessage(BHPMOD_ERROR_PARAMETER, "Bad offset or length given", "Parameter Error")
+#define ErrorNullPointer()          ErrorMessage(BHPMOD_ERROR_PARAMETER, "Data pointer provided is NULL", "Parameter Error")
+#define ErrorNotErased()            ErrorMessage(BHPMOD_ERROR_ORDER, "The FPGA must be erased to program", "Operation Order Error")
+#define ErrorNotOpen()              ErrorMessage(BHPMOD_ERROR_ORDER, "The SPI connection has not been initialized", "Operation Order Error")
+#define ErrorTimeout()              ErrorMessage(BHPMOD_ERROR_TIMEOUT, "Timed out waiting for FPGA busy", "Timeout Error")
 
 /* Local data definitions */
 
@@ -766,14 +766,16 @@ BYTE JEDEC_ReadFuseByte(BYTE *FuseByte)
 /* General Purpose And Helper Subroutines                                   */
 /*--------------------------------------------------------------------------*/
 
-/* ERRORMESSAGE notifies the user of an error specified by a text string.  
+/* ERRORMESSAGE reports an error specified by a code and a text string.  
+   It is handed to the BHPMOD API so that it reaches the application in the
+   same way as errors of the API, by BHPMOD_GetLastError, the error log and
+   the error callback, and in a dialog only if dialogs have been enabled.
    A zero is returned for convenience.  
 */
 
-DWORD ErrorMessage(char *ErrorDescription, char *ErrorType) 
+DWORD ErrorMessage(DWORD Code, char *ErrorDescription, char *ErrorType) 
  {
-  MessageBox(NULL, ErrorDescription, ErrorType, MB_ICONSTOP | MB_TASKMODAL);
-  return(0);
+  return(BHPMOD_ReportError(Code, ErrorDescription, ErrorType));
  } 
 
 /*--------------------------------------------------------------------------*/